@@ -0,0 +1,560 @@
+/// throughput/latency benchmark of the simple binary protocol
+/// sweeps message size, kind, byte swapping, number of concurrent connections and
+/// mode (pingpong: the server echoes each message, stream: the client sends messages
+/// back to back and the server acknowledges them at the end) over loopback, and writes
+/// one json object per line on stdout for each point:
+///   {"harness":"c","mode":"pingpong","kind":"double","swap":0,"conns":1,"size":8,
+///    "msgs":..,"seconds":..,"MB_per_s":..,"msgs_per_s":..,"p50_us":..,"p99_us":..,"p999_us":..}
+/// MB/s counts the payload sent by the clients (once per round trip in pingpong mode),
+/// latencies are the round trip times (null in stream mode).
+/// Byte swapping is forced on both ends (it is the swap a big endian host would do).
+///
+/// By default the server is forked locally, with -l the program is just a server
+/// (for example for the D harness tests/SbpBench.d), with -a host the clients connect
+/// to a server started with -l on host.
+/// Run it without arguments for the full sweep (8 B to 1 GiB), or see -h.
+/// author: fawzi
+//
+// Copyright 2008-2010 the blip developer group
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// this file is explicitly released also with GPLv2 for the projects that might need it
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "SimpleProtocol.h"
+
+// from SimpleProtocol.c
+extern int swapBits;
+
+enum{
+    max_list=16,
+    ctl_len=16,         // length of the control message
+    warmup_msgs=10,
+    warmup_max_size=1048576
+};
+
+/// options of the benchmark
+typedef struct bench_opts{
+    const char *modes[max_list];
+    int nModes;
+    const char *kinds[max_list];
+    int nKinds;
+    int swaps[max_list];
+    int nSwaps;
+    int conns[max_list];
+    int nConns;
+    uint64_t minSize,maxSize;
+    int factor;
+    double seconds;
+    uint64_t maxMsgs;
+    int noDelay,pack,shm;
+    const char *host;
+    const char *port;
+} bench_opts;
+
+/// a point of the sweep as seen by one connection
+typedef struct bench_conn{
+    pthread_t thread;
+    const bench_opts *opts;
+    pthread_barrier_t *barrier;
+    int pingpong;
+    int kind;
+    int swap;
+    uint64_t size;
+    // results
+    int err;
+    uint64_t msgs;
+    double t0,t1;
+    double *lat;
+} bench_conn;
+
+static double benchNow(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return (double)t.tv_sec+1.e-9*(double)t.tv_nsec;
+}
+
+static int benchKind(const char *name){
+    if (strcmp(name,"raw")==0) return kind_raw;
+    if (strcmp(name,"char")==0) return kind_char;
+    if (strcmp(name,"int")==0) return kind_int_small;
+    if (strcmp(name,"double")==0) return kind_double_small;
+    return -1;
+}
+
+static int benchSplit(char *list,const char **res){
+    int n=0;
+    char *tok=strtok(list,",");
+    while (tok && n<max_list){
+        res[n++]=tok;
+        tok=strtok(NULL,",");
+    }
+    return n;
+}
+
+static int benchSplitInt(char *list,int *res){
+    const char *toks[max_list];
+    int n=benchSplit(list,toks),i;
+    for (i=0;i<n;++i) res[i]=atoi(toks[i]);
+    return n;
+}
+
+/// parses sizes like 8, 64K, 16M, 1G (powers of 1024)
+static uint64_t benchParseSize(const char *s){
+    char *end;
+    uint64_t v=strtoull(s,&end,10);
+    switch (*end){
+    case 'k': case 'K': return v<<10;
+    case 'm': case 'M': return v<<20;
+    case 'g': case 'G': return v<<30;
+    default: return v;
+    }
+}
+
+static void benchSetNoDelay(socket_t sock){
+    int one=1;
+    if (!sbpShmActive(sock)) setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+}
+
+//////// server ////////
+
+static int benchServerNoDelay=0;
+static int benchSwapUsers=0;
+static pthread_mutex_t benchSwapLock=PTHREAD_MUTEX_INITIALIZER;
+
+/// sends back the message in p with the sending call that a user would use
+static int benchEcho(socket_t sock,int kind,char *p,uint64_t len){
+    switch (kind){
+    case kind_char:
+        return sbpSendChars64(sock,p,len);
+    case kind_int_small:
+    case kind_int_packed:
+        return sbpSendInt4Array64(sock,p,len/4);
+    case kind_double_small:
+    case kind_double_packed:
+        return sbpSendDoubleArray64(sock,p,len/8);
+    default:
+        if (sbpSendHeader64(sock,kind_raw,len)!=0) return 3;
+        return sbpSendCharsPiece64(sock,p,len);
+    }
+}
+
+/// serves one point: a control message "sbpbench <pingpong> <swap>" answered with
+/// "go", then messages until one of length 0, acknowledged with "ok".
+/// swapBits is global, so control and answers are ctl_len/2 bytes without header, and
+/// the server swaps as long as one of its connections asked for it (the clients of a
+/// point all use the same setting, and connect only when the previous point is over)
+static void *benchServeConnection(void *arg){
+    socket_t sock=(socket_t)(intptr_t)arg;
+    char *buf=NULL;
+    char ctl[ctl_len+1];
+    uint64_t bufSize=0,len;
+    uint32_t kind;
+    int pingpong=0,swap=0,err=0;
+    if (benchServerNoDelay) benchSetNoDelay(sock);
+    if (sbpReadCharsPiece64(sock,ctl,ctl_len)!=0){
+        sbpClose(sock,2);
+        return NULL;
+    }
+    ctl[ctl_len]=0;
+    if (sscanf(ctl,"sbpbench %d %d",&pingpong,&swap)!=2){
+        fprintf(stderr,"SbpBench unexpected control message '%s'\n",ctl);
+        sbpClose(sock,2);
+        return NULL;
+    }
+    if (swap){
+        pthread_mutex_lock(&benchSwapLock);
+        if (benchSwapUsers++==0) swapBits=1;
+        pthread_mutex_unlock(&benchSwapLock);
+    }
+    err=sbpSendCharsPiece64(sock,"go",2);
+    while (!err){
+        if (sbpReadHeader64(sock,&kind,&len)!=0){
+            err=1;
+            break;
+        }
+        if (len==0) break;
+        if (len>bufSize){
+            free(buf);
+            buf=(char*)malloc(len);
+            bufSize=(buf)?len:0;
+            if (!buf){
+                fprintf(stderr,"SbpBench server could not allocate %llu bytes\n",(unsigned long long)len);
+                err=1;
+                break;
+            }
+        }
+        switch (kind){
+        case kind_int_small:
+            err=sbpRead4_64(sock,buf,len);
+            break;
+        case kind_double_small:
+            err=sbpRead8_64(sock,buf,len);
+            break;
+        case kind_int_packed:
+        case kind_double_packed:
+            err=sbpReadPacked64(sock,kind,buf,len);
+            break;
+        default:
+            err=sbpReadCharsPiece64(sock,buf,len);
+        }
+        if (!err && pingpong) err=benchEcho(sock,kind,buf,len);
+    }
+    if (swap){
+        pthread_mutex_lock(&benchSwapLock);
+        if (--benchSwapUsers==0) swapBits=0;
+        pthread_mutex_unlock(&benchSwapLock);
+    }
+    if (!err) sbpSendCharsPiece64(sock,"ok",2);
+    free(buf);
+    sbpClose(sock,2);
+    return NULL;
+}
+
+static int benchServe(const char *port){
+    socket_t lSock;
+    if (sbpListenForService32(&lSock,(char*)port,(uint32_t)strlen(port))!=0){
+        fprintf(stderr,"SbpBench could not listen on port %s\n",port);
+        return 1;
+    }
+    while (1){
+        socket_t sock;
+        char addr[256];
+        uint32_t addrLen=sizeof(addr);
+        pthread_t t;
+        if (sbpAccept32(lSock,&sock,addr,&addrLen)!=0) continue;
+        if (pthread_create(&t,NULL,&benchServeConnection,(void*)(intptr_t)sock)!=0){
+            sbpClose(sock,2);
+            continue;
+        }
+        pthread_detach(t);
+    }
+    return 0;
+}
+
+//////// clients ////////
+
+static void benchFill(char *p,int kind,uint64_t size){
+    uint64_t i;
+    if (kind==kind_double_small){
+        double *d=(double*)p;
+        for (i=0;i<size/8;++i) d[i]=sin(1.e-3*(double)i);
+    } else if (kind==kind_int_small){
+        int32_t *iv=(int32_t*)p;
+        for (i=0;i<size/4;++i) iv[i]=(int32_t)(i/3);
+    } else {
+        for (i=0;i<size;++i) p[i]=(char)('a'+i%26);
+    }
+}
+
+static int benchSend(socket_t sock,int kind,char *p,uint64_t size){
+    switch (kind){
+    case kind_char: return sbpSendChars64(sock,p,size);
+    case kind_int_small: return sbpSendInt4Array64(sock,p,size/4);
+    case kind_double_small: return sbpSendDoubleArray64(sock,p,size/8);
+    default:
+        if (sbpSendHeader64(sock,kind_raw,size)!=0) return 3;
+        return sbpSendCharsPiece64(sock,p,size);
+    }
+}
+
+static int benchRecv(socket_t sock,int kind,char *p,uint64_t size){
+    switch (kind){
+    case kind_char:{
+        uint64_t len=size;
+        int err=sbpReadChars64(sock,p,&len);
+        return (err!=0 || len!=size)?1:0;
+    }
+    case kind_int_small: return sbpReadInt4Array64(sock,p,size/4);
+    case kind_double_small: return sbpReadDoubleArray64(sock,p,size/8);
+    default:{
+        uint32_t rKind;
+        uint64_t len;
+        if (sbpReadHeader64(sock,&rKind,&len)!=0 || rKind!=kind_raw || len!=size) return 1;
+        return sbpReadCharsPiece64(sock,p,size);
+    }
+    }
+}
+
+static int benchEnd(socket_t sock,int kind){
+    char ok[2];
+    if (sbpSendHeader64(sock,kind,0)!=0) return 1;
+    return sbpReadCharsPiece64(sock,ok,2);
+}
+
+static void *benchClient(void *arg){
+    bench_conn *c=(bench_conn*)arg;
+    const bench_opts *o=c->opts;
+    char addr[256],ctl[ctl_len+1],go[2];
+    char *sendBuf=NULL,*recvBuf=NULL;
+    socket_t sock=-1;
+    uint64_t i,maxMsgs=o->maxMsgs;
+    snprintf(addr,sizeof(addr),"%s %s",o->host,o->port);
+    memset(ctl,' ',sizeof(ctl));
+    snprintf(ctl,sizeof(ctl),"sbpbench %d %d",c->pingpong,c->swap);
+    if (sbpConnectTo32(&sock,addr,(uint32_t)strlen(addr))!=0){
+        c->err=1;
+        sock=-1;
+    } else {
+        if (o->noDelay) benchSetNoDelay(sock);
+        sendBuf=(char*)malloc(c->size);
+        recvBuf=(c->pingpong)?(char*)malloc(c->size):NULL;
+        c->lat=(c->pingpong)?(double*)malloc(maxMsgs*sizeof(double)):NULL;
+        if (!sendBuf || (c->pingpong && (!recvBuf || !c->lat))
+            || sbpSendCharsPiece64(sock,ctl,ctl_len)!=0 || sbpReadCharsPiece64(sock,go,2)!=0){
+            c->err=2;
+        } else {
+            benchFill(sendBuf,c->kind,c->size);
+        }
+    }
+    // all connections are set up (with swapBits=0, as the server), switch swapBits
+    if (pthread_barrier_wait(c->barrier)==PTHREAD_BARRIER_SERIAL_THREAD) swapBits=c->swap;
+    pthread_barrier_wait(c->barrier);
+    if (!c->err && c->size<=warmup_max_size){
+        for (i=0;i<warmup_msgs && !c->err;++i){
+            if (benchSend(sock,c->kind,sendBuf,c->size)!=0
+                || (c->pingpong && benchRecv(sock,c->kind,recvBuf,c->size)!=0)) c->err=3;
+        }
+    }
+    pthread_barrier_wait(c->barrier);
+    c->t0=benchNow();
+    for (i=0;i<maxMsgs && !c->err;){
+        double t=benchNow();
+        if (benchSend(sock,c->kind,sendBuf,c->size)!=0){
+            c->err=4;
+            break;
+        }
+        if (c->pingpong){
+            if (benchRecv(sock,c->kind,recvBuf,c->size)!=0){
+                c->err=5;
+                break;
+            }
+            c->lat[i]=benchNow()-t;
+        }
+        ++i;
+        if (benchNow()-c->t0>o->seconds) break;
+    }
+    c->msgs=i;
+    if (!c->err && benchEnd(sock,c->kind)!=0) c->err=6;
+    c->t1=benchNow();
+    if (sock>=0) sbpClose(sock,2);
+    free(sendBuf);
+    free(recvBuf);
+    return NULL;
+}
+
+static int benchCmpDouble(const void *a,const void *b){
+    double x=*(const double*)a,y=*(const double*)b;
+    return (x<y)?-1:((x>y)?1:0);
+}
+
+static void benchPrintPercentile(const char *name,double *lat,uint64_t n,double q){
+    if (n==0){
+        printf(",\"%s\":null",name);
+    } else {
+        uint64_t i=(uint64_t)(q*(double)n);
+        if (i>=n) i=n-1;
+        printf(",\"%s\":%.3f",name,1.e6*lat[i]);
+    }
+}
+
+/// runs one point of the sweep, returns 0 if successful
+static int benchPoint(const bench_opts *o,const char *mode,const char *kindName,int swap,
+    int nConn,uint64_t size)
+{
+    bench_conn conns[64];
+    pthread_barrier_t barrier;
+    uint64_t msgs=0,nLat=0;
+    double t0=0,t1=0,*lat=NULL;
+    int kind=benchKind(kindName),c,err=0;
+    if (nConn>64) nConn=64;
+    swapBits=0;
+    pthread_barrier_init(&barrier,NULL,(unsigned)nConn);
+    for (c=0;c<nConn;++c){
+        memset(&conns[c],0,sizeof(bench_conn));
+        conns[c].opts=o;
+        conns[c].barrier=&barrier;
+        conns[c].pingpong=(strcmp(mode,"pingpong")==0);
+        conns[c].kind=kind;
+        conns[c].swap=swap;
+        conns[c].size=size;
+        if (pthread_create(&conns[c].thread,NULL,&benchClient,&conns[c])!=0){
+            fprintf(stderr,"SbpBench could not start the client threads\n");
+            exit(1);
+        }
+    }
+    for (c=0;c<nConn;++c){
+        pthread_join(conns[c].thread,NULL);
+        if (conns[c].err){
+            fprintf(stderr,"SbpBench error %d in connection %d of %s %s size %llu\n",
+                conns[c].err,c,mode,kindName,(unsigned long long)size);
+            err=1;
+        }
+        msgs+=conns[c].msgs;
+        if (c==0 || conns[c].t0<t0) t0=conns[c].t0;
+        if (c==0 || conns[c].t1>t1) t1=conns[c].t1;
+        if (conns[c].lat) nLat+=conns[c].msgs;
+    }
+    pthread_barrier_destroy(&barrier);
+    swapBits=0;
+    if (nLat>0 && !err){
+        lat=(double*)malloc(nLat*sizeof(double));
+        nLat=0;
+        for (c=0;c<nConn && lat;++c){
+            if (conns[c].lat){
+                memcpy(lat+nLat,conns[c].lat,conns[c].msgs*sizeof(double));
+                nLat+=conns[c].msgs;
+            }
+        }
+        if (lat) qsort(lat,nLat,sizeof(double),&benchCmpDouble);
+        else nLat=0;
+    }
+    for (c=0;c<nConn;++c) free(conns[c].lat);
+    if (err){
+        free(lat);
+        return 1;
+    }
+    printf("{\"harness\":\"c\",\"mode\":\"%s\",\"kind\":\"%s\",\"swap\":%d,\"conns\":%d,"
+        "\"size\":%llu,\"nodelay\":%d,\"pack\":%d,\"shm\":%d,\"msgs\":%llu,\"seconds\":%.6f,"
+        "\"MB_per_s\":%.3f,\"msgs_per_s\":%.1f",mode,kindName,swap,nConn,(unsigned long long)size,
+        o->noDelay,o->pack,o->shm,(unsigned long long)msgs,t1-t0,
+        1.e-6*(double)msgs*(double)size/(t1-t0),(double)msgs/(t1-t0));
+    benchPrintPercentile("p50_us",lat,nLat,0.5);
+    benchPrintPercentile("p99_us",lat,nLat,0.99);
+    benchPrintPercentile("p999_us",lat,nLat,0.999);
+    printf("}\n");
+    fflush(stdout);
+    free(lat);
+    return 0;
+}
+
+static void benchUsage(const char *name){
+    fprintf(stderr,"usage: %s [options]\n"
+        "  -m modes     comma separated list of pingpong,stream (default both)\n"
+        "  -k kinds     comma separated list of raw,char,int,double (default all)\n"
+        "  -x swaps     comma separated list of 0 (no swap),1 (forced swap) (default 0,1)\n"
+        "  -c conns     comma separated list of concurrent connections (default 1)\n"
+        "  -s size      minimum message size in bytes, K/M/G suffixes accepted (default 8)\n"
+        "  -S size      maximum message size (default 1G)\n"
+        "  -f factor    size multiplication factor of the sweep (default 4)\n"
+        "  -t seconds   time spent on each point (default 1)\n"
+        "  -n msgs      maximum number of messages per connection and point (default 1000000)\n"
+        "  -N           sets TCP_NODELAY on the connections\n"
+        "  -P           enables packed payloads (sbpPackEnable)\n"
+        "  -M           enables the shared memory transport (sbpShmEnable)\n"
+        "  -p port      port to use (default 47300)\n"
+        "  -l           only runs the server\n"
+        "  -a host      runs the clients against a server (started with -l) on host\n",name);
+}
+
+int main(int argc,char *argv[]){
+    bench_opts o;
+    char modes[]="pingpong,stream",kinds[]="raw,char,int,double",swaps[]="0,1",conns[]="1";
+    int serverOnly=0,external=0,opt,iMode,iKind,iSwap,iConn,err=0;
+    pid_t server=0;
+    memset(&o,0,sizeof(o));
+    o.minSize=8;
+    o.maxSize=((uint64_t)1)<<30;
+    o.factor=4;
+    o.seconds=1.0;
+    o.maxMsgs=1000000;
+    o.host="localhost";
+    o.port="47300";
+    o.nModes=benchSplit(modes,o.modes);
+    o.nKinds=benchSplit(kinds,o.kinds);
+    o.nSwaps=benchSplitInt(swaps,o.swaps);
+    o.nConns=benchSplitInt(conns,o.conns);
+    while ((opt=getopt(argc,argv,"m:k:x:c:s:S:f:t:n:NPMp:la:h"))!=-1){
+        switch (opt){
+        case 'm': o.nModes=benchSplit(optarg,o.modes); break;
+        case 'k': o.nKinds=benchSplit(optarg,o.kinds); break;
+        case 'x': o.nSwaps=benchSplitInt(optarg,o.swaps); break;
+        case 'c': o.nConns=benchSplitInt(optarg,o.conns); break;
+        case 's': o.minSize=benchParseSize(optarg); break;
+        case 'S': o.maxSize=benchParseSize(optarg); break;
+        case 'f': o.factor=atoi(optarg); break;
+        case 't': o.seconds=atof(optarg); break;
+        case 'n': o.maxMsgs=strtoull(optarg,NULL,10); break;
+        case 'N': o.noDelay=1; break;
+        case 'P': o.pack=1; break;
+        case 'M': o.shm=1; break;
+        case 'p': o.port=optarg; break;
+        case 'l': serverOnly=1; break;
+        case 'a': o.host=optarg; external=1; break;
+        default:
+            benchUsage(argv[0]);
+            return 1;
+        }
+    }
+    for (iMode=0;iMode<o.nModes;++iMode){
+        if (strcmp(o.modes[iMode],"pingpong")!=0 && strcmp(o.modes[iMode],"stream")!=0){
+            fprintf(stderr,"SbpBench unknown mode %s\n",o.modes[iMode]);
+            return 1;
+        }
+    }
+    for (iKind=0;iKind<o.nKinds;++iKind){
+        if (benchKind(o.kinds[iKind])<0){
+            fprintf(stderr,"SbpBench unknown kind %s\n",o.kinds[iKind]);
+            return 1;
+        }
+    }
+    if (o.factor<2) o.factor=2;
+    if (o.maxMsgs==0) o.maxMsgs=1;
+    if (o.minSize<8) o.minSize=8;
+    signal(SIGPIPE,SIG_IGN);
+    sbpInit();
+    sbpPackEnable(o.pack,0);
+    sbpShmEnable(o.shm,0);
+    benchServerNoDelay=o.noDelay;
+    if (serverOnly) return benchServe(o.port);
+    if (!external){
+        server=fork();
+        if (server<0){
+            perror("SbpBench fork");
+            return 1;
+        }
+        if (server==0) return benchServe(o.port);
+        usleep(200000); // lets the server start listening
+    }
+    for (iMode=0;iMode<o.nModes;++iMode)
+        for (iKind=0;iKind<o.nKinds;++iKind)
+            for (iSwap=0;iSwap<o.nSwaps;++iSwap)
+                for (iConn=0;iConn<o.nConns;++iConn){
+                    uint64_t size=o.minSize;
+                    while (1){
+                        // whole elements for int and double
+                        err|=benchPoint(&o,o.modes[iMode],o.kinds[iKind],
+                            o.swaps[iSwap],o.conns[iConn],size&~(uint64_t)7);
+                        if (size>=o.maxSize) break;
+                        size*=(uint64_t)o.factor;
+                        if (size>o.maxSize) size=o.maxSize;
+                    }
+                }
+    if (server>0){
+        kill(server,SIGTERM);
+        waitpid(server,NULL,0);
+    }
+    return err;
+}
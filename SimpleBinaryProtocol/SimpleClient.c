@@ -62,6 +62,24 @@ int main(int argc,char*argv[]){
     }
     printf("sent d11\n");
     printf("did send test\n");
+    {
+        sbp_batch *batch;
+        if (sbpBatchInit(&batch,sock)){
+            printf("error creating batch\n");
+            return 2;
+        }
+        if (sbpBatchAddChars32(batch,"doTests",7)
+            || sbpBatchAddChars32(batch,&cA[0],8)
+            || sbpBatchAddInt4Array32(batch,&iA[0],10)
+            || sbpBatchAddDoubleArray32(batch,&dA[0],11)){
+            printf("error adding to batch\n");
+        }
+        if (sbpBatchFlush(batch)){
+            printf("error flushing batch\n");
+        }
+        sbpBatchFree(batch);
+        printf("did send batched test\n");
+    }
     sbpClose(sock,1);
     printf("closed Socket\n");
     sleep(10);
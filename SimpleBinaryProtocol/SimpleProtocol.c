@@ -27,27 +27,72 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include "SimpleProtocol.h"
 //#include <unistd.h>
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 enum SBP_SIZES{
     max_listening_sockets=10,
-    endian_buf_size=1024
+    endian_buf_size=1024,
+    swap_buf_size=65536,      // chunk size used when sending byte swapped data
+    batch_inline_size=512,    // payloads up to this size are copied into the batch buffer
+    batch_initial_entries=64,
+    batch_initial_buf=4096,
+    reader_default_size=262144 // default buffer size of an sbp_reader
+};
+
+/// a piece of a batch, either a reference to user memory (ptr!=NULL) or a
+/// range in the batch buffer (offset/len)
+struct sbp_batch_entry{
+    char *ptr;
+    size_t offset;
+    size_t len;
+};
+
+struct sbp_batch{
+    socket_t sock;
+    char *buf;                        // owned data: headers, small and swapped payloads
+    size_t bufLen,bufCapacity;
+    struct sbp_batch_entry *entries;
+    size_t nEntries,entriesCapacity;
+    struct iovec *iov;                // scratch space used by sbpBatchFlush
+    size_t iovCapacity;
 };
 
 struct sbp_listening_sockets{
     int externalId;
     int nSockets;
-    int maxDesc;
     int lastISock;
     socket_t socktable[max_listening_sockets];
     int sockfamile[max_listening_sockets];
-    fd_set selectSet;
     struct sbp_listening_sockets *next;
 };
 
+/// buffered receive context of a socket, data is kept in buf[start..end]
+struct sbp_reader{
+    socket_t sock;
+    char *buf;
+    size_t start,end,capacity;
+};
+
 struct sbp_listening_sockets *sbpListeningSockets=NULL;
 int swapBits=0;
+/// the readers attached to the sockets, indexed by socket
+/// the size is in the same block as the entries, and the block is published atomically;
+/// when grown the old table is not freed, so that lookups need no lock
+typedef struct sbp_reader_table{
+    size_t size;
+    sbp_reader *readers[];
+} sbp_reader_table;
+sbp_reader_table *sbpReaders=NULL;
+pthread_mutex_t sbpReadersLock=PTHREAD_MUTEX_INITIALIZER;
 
 void reduceLen64(char*name,uint64_t*len){
     uint64_t i,l= *len;
@@ -69,10 +114,189 @@ void reduceLen32(char*name,uint32_t*len){
     }
 }
 
+//////// byte swapping ////////
+// the kernels invert the byte order of each element while copying len bytes from
+// src to dst. They load a whole block before storing it, so dst==src is allowed.
+
+#if defined(__GNUC__)
+#define sbpBswap32(x) __builtin_bswap32(x)
+#define sbpBswap64(x) __builtin_bswap64(x)
+#else
+static uint32_t sbpBswap32(uint32_t x){
+    return (x>>24)|((x>>8)&0xFF00U)|((x<<8)&0xFF0000U)|(x<<24);
+}
+static uint64_t sbpBswap64(uint64_t x){
+    return (((uint64_t)sbpBswap32((uint32_t)x))<<32)|(uint64_t)sbpBswap32((uint32_t)(x>>32));
+}
+#endif
+
+static void sbpCopyInvert4Word(char *dst,const char *src,size_t len){
+    size_t i;
+    for (i=0;i+4<=len;i+=4){
+        uint32_t v;
+        memcpy(&v,src+i,4);
+        v=sbpBswap32(v);
+        memcpy(dst+i,&v,4);
+    }
+}
+
+static void sbpCopyInvert8Word(char *dst,const char *src,size_t len){
+    size_t i;
+    for (i=0;i+8<=len;i+=8){
+        uint64_t v;
+        memcpy(&v,src+i,8);
+        v=sbpBswap64(v);
+        memcpy(dst+i,&v,8);
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SBP_X86_SIMD 1
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void sbpCopyInvert4Sse2(char *dst,const char *src,size_t len){
+    size_t i;
+    for (i=0;i+16<=len;i+=16){
+        __m128i v=_mm_loadu_si128((const __m128i*)(src+i));
+        v=_mm_or_si128(_mm_slli_epi16(v,8),_mm_srli_epi16(v,8));
+        v=_mm_shufflelo_epi16(v,_MM_SHUFFLE(2,3,0,1));
+        v=_mm_shufflehi_epi16(v,_MM_SHUFFLE(2,3,0,1));
+        _mm_storeu_si128((__m128i*)(dst+i),v);
+    }
+    sbpCopyInvert4Word(dst+i,src+i,len-i);
+}
+
+__attribute__((target("sse2")))
+static void sbpCopyInvert8Sse2(char *dst,const char *src,size_t len){
+    size_t i;
+    for (i=0;i+16<=len;i+=16){
+        __m128i v=_mm_loadu_si128((const __m128i*)(src+i));
+        v=_mm_or_si128(_mm_slli_epi16(v,8),_mm_srli_epi16(v,8));
+        v=_mm_shufflelo_epi16(v,_MM_SHUFFLE(0,1,2,3));
+        v=_mm_shufflehi_epi16(v,_MM_SHUFFLE(0,1,2,3));
+        _mm_storeu_si128((__m128i*)(dst+i),v);
+    }
+    sbpCopyInvert8Word(dst+i,src+i,len-i);
+}
+
+__attribute__((target("ssse3")))
+static void sbpCopyInvert4Ssse3(char *dst,const char *src,size_t len){
+    const __m128i mask=_mm_set_epi8(12,13,14,15,8,9,10,11,4,5,6,7,0,1,2,3);
+    size_t i;
+    for (i=0;i+32<=len;i+=32){
+        __m128i v0=_mm_loadu_si128((const __m128i*)(src+i));
+        __m128i v1=_mm_loadu_si128((const __m128i*)(src+i+16));
+        _mm_storeu_si128((__m128i*)(dst+i),_mm_shuffle_epi8(v0,mask));
+        _mm_storeu_si128((__m128i*)(dst+i+16),_mm_shuffle_epi8(v1,mask));
+    }
+    for (;i+16<=len;i+=16){
+        __m128i v=_mm_loadu_si128((const __m128i*)(src+i));
+        _mm_storeu_si128((__m128i*)(dst+i),_mm_shuffle_epi8(v,mask));
+    }
+    sbpCopyInvert4Word(dst+i,src+i,len-i);
+}
+
+__attribute__((target("ssse3")))
+static void sbpCopyInvert8Ssse3(char *dst,const char *src,size_t len){
+    const __m128i mask=_mm_set_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7);
+    size_t i;
+    for (i=0;i+32<=len;i+=32){
+        __m128i v0=_mm_loadu_si128((const __m128i*)(src+i));
+        __m128i v1=_mm_loadu_si128((const __m128i*)(src+i+16));
+        _mm_storeu_si128((__m128i*)(dst+i),_mm_shuffle_epi8(v0,mask));
+        _mm_storeu_si128((__m128i*)(dst+i+16),_mm_shuffle_epi8(v1,mask));
+    }
+    for (;i+16<=len;i+=16){
+        __m128i v=_mm_loadu_si128((const __m128i*)(src+i));
+        _mm_storeu_si128((__m128i*)(dst+i),_mm_shuffle_epi8(v,mask));
+    }
+    sbpCopyInvert8Word(dst+i,src+i,len-i);
+}
+
+__attribute__((target("avx2")))
+static void sbpCopyInvert4Avx2(char *dst,const char *src,size_t len){
+    const __m256i mask=_mm256_set_epi8(12,13,14,15,8,9,10,11,4,5,6,7,0,1,2,3,
+                                       12,13,14,15,8,9,10,11,4,5,6,7,0,1,2,3);
+    size_t i;
+    for (i=0;i+64<=len;i+=64){
+        __m256i v0=_mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i v1=_mm256_loadu_si256((const __m256i*)(src+i+32));
+        _mm256_storeu_si256((__m256i*)(dst+i),_mm256_shuffle_epi8(v0,mask));
+        _mm256_storeu_si256((__m256i*)(dst+i+32),_mm256_shuffle_epi8(v1,mask));
+    }
+    for (;i+32<=len;i+=32){
+        __m256i v=_mm256_loadu_si256((const __m256i*)(src+i));
+        _mm256_storeu_si256((__m256i*)(dst+i),_mm256_shuffle_epi8(v,mask));
+    }
+    sbpCopyInvert4Word(dst+i,src+i,len-i);
+}
+
+__attribute__((target("avx2")))
+static void sbpCopyInvert8Avx2(char *dst,const char *src,size_t len){
+    const __m256i mask=_mm256_set_epi8(8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7,
+                                       8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7);
+    size_t i;
+    for (i=0;i+64<=len;i+=64){
+        __m256i v0=_mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i v1=_mm256_loadu_si256((const __m256i*)(src+i+32));
+        _mm256_storeu_si256((__m256i*)(dst+i),_mm256_shuffle_epi8(v0,mask));
+        _mm256_storeu_si256((__m256i*)(dst+i+32),_mm256_shuffle_epi8(v1,mask));
+    }
+    for (;i+32<=len;i+=32){
+        __m256i v=_mm256_loadu_si256((const __m256i*)(src+i));
+        _mm256_storeu_si256((__m256i*)(dst+i),_mm256_shuffle_epi8(v,mask));
+    }
+    sbpCopyInvert8Word(dst+i,src+i,len-i);
+}
+#endif
+
+/// the swap kernels in use, selected by sbpSelectSwapKernels
+void (*sbpCopyInvert4Kernel)(char *dst,const char *src,size_t len)=&sbpCopyInvert4Word;
+void (*sbpCopyInvert8Kernel)(char *dst,const char *src,size_t len)=&sbpCopyInvert8Word;
+const char *sbpSwapKernelName="word";
+
+/// chooses the fastest swap kernels supported by the cpu
+void sbpSelectSwapKernels(){
+#ifdef SBP_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        sbpCopyInvert4Kernel=&sbpCopyInvert4Avx2;
+        sbpCopyInvert8Kernel=&sbpCopyInvert8Avx2;
+        sbpSwapKernelName="avx2";
+    } else if (__builtin_cpu_supports("ssse3")){
+        sbpCopyInvert4Kernel=&sbpCopyInvert4Ssse3;
+        sbpCopyInvert8Kernel=&sbpCopyInvert8Ssse3;
+        sbpSwapKernelName="ssse3";
+    } else if (__builtin_cpu_supports("sse2")){
+        sbpCopyInvert4Kernel=&sbpCopyInvert4Sse2;
+        sbpCopyInvert8Kernel=&sbpCopyInvert8Sse2;
+        sbpSwapKernelName="sse2";
+    }
+#endif
+}
+
+void sbpCopyInvert4(void *dst,const void *src,uint64_t len){
+    sbpCopyInvert4Kernel((char*)dst,(const char*)src,(size_t)len);
+}
+
+void sbpCopyInvert8(void *dst,const void *src,uint64_t len){
+    sbpCopyInvert8Kernel((char*)dst,(const char*)src,(size_t)len);
+}
+
+void sbpInvert4InPlace(void *p,uint64_t len){
+    sbpCopyInvert4Kernel((char*)p,(const char*)p,(size_t)len);
+}
+
+void sbpInvert8InPlace(void *p,uint64_t len){
+    sbpCopyInvert8Kernel((char*)p,(const char*)p,(size_t)len);
+}
+
 int sbpInit(){
     int i=1;
     swapBits=(*(char *)&i)!=1; // small endian is the default
-    fprintf(stderr,"SBP init, swapBits %d\n",swapBits);
+    sbpSelectSwapKernels();
+    fprintf(stderr,"SBP init, swapBits %d, swap kernels %s\n",swapBits,sbpSwapKernelName);
     return 0;
 }
 /// f77 interface
@@ -100,9 +324,62 @@ void sbpend__(int*ierr){
     *ierr=sbpEnd();
 }
 
-int sbpSendHeader64(socket_t sock, int32_t kind, uint64_t len){
-    uint64_t buf[2];
-    char* bufPos=(char*)&buf;
+int sbpSendDirect(socket_t sock,void* start,uint64_t len);
+int sbpSendInvert4(socket_t sock,void* start,uint64_t len);
+int sbpSendInvert8(socket_t sock,void* start,uint64_t len);
+int sbpReadDirect(socket_t sock,void* start,uint64_t len);
+int sbpReadInvert4(socket_t sock,void* start,uint64_t len);
+int sbpReadInvert8(socket_t sock,void* start,uint64_t len);
+// from SimpleProtocolShm.c
+sbp_shm *sbpShmFor(socket_t sock);
+int sbpShmWriteV(sbp_shm *shm,struct iovec *iov,size_t iovcnt);
+int sbpShmRead(sbp_shm *shm,void *dst,uint64_t len);
+int sbpShmClose(socket_t sock,int what);
+// from SimpleProtocolPack.c
+int sbpPackUse(socket_t sock,uint64_t byteLen);
+void sbpPackSetPeer(socket_t sock,int packed);
+int sbpHandshakeConnect(socket_t sock);
+int sbpHandshakeAccept(socket_t sock);
+int sbpHandshakeLate(socket_t sock,uint64_t len);
+
+/// writes all the given iovecs, handling partial writes, interruptions and
+/// non blocking sockets, the iovecs are modified
+int sbpWriteAllV(socket_t sock,struct iovec *iov,size_t iovcnt){
+    sbp_shm *shm=sbpShmFor(sock);
+    if (shm) return sbpShmWriteV(shm,iov,iovcnt);
+    while (iovcnt>0){
+        int nV=(iovcnt>IOV_MAX)?IOV_MAX:(int)iovcnt;
+        ssize_t written=writev(sock,iov,nV);
+        if (written<0){
+            if (errno==EINTR) continue;
+            if (errno==EAGAIN || errno==EWOULDBLOCK){
+                struct pollfd pfd;
+                pfd.fd=sock;
+                pfd.events=POLLOUT;
+                pfd.revents=0;
+                if (poll(&pfd,1,-1)<0 && errno!=EINTR){
+                    perror("SBP error waiting for socket to become writable");
+                    return 2;
+                }
+                continue;
+            }
+            perror("SBP error in vectored send");
+            return 1;
+        }
+        while (iovcnt>0 && (size_t)written>=iov->iov_len){
+            written-=iov->iov_len;
+            ++iov; --iovcnt;
+        }
+        if (iovcnt>0 && written>0){
+            iov->iov_base=((char*)iov->iov_base)+written;
+            iov->iov_len-=(size_t)written;
+        }
+    }
+    return 0;
+}
+
+/// encodes the 12 bytes header in buf
+void sbpEncodeHeader(char *bufPos, int32_t kind, uint64_t len){
     char* pos;
     if (swapBits){
         pos=(char*)&kind;
@@ -120,14 +397,17 @@ int sbpSendHeader64(socket_t sock, int32_t kind, uint64_t len){
         bufPos[2]=pos[5];
         bufPos[1]=pos[6];
         bufPos[0]=pos[7];
-        bufPos+=8;
     } else {
-        *((uint32_t*)bufPos)=kind;
-        bufPos+=4;
-        *((uint64_t*)bufPos)=len;
+        memcpy(bufPos,&kind,4);
+        memcpy(bufPos+4,&len,8);
     }
-    if (write(sock,&buf,12)!=12) {
-        perror("SBP error sending header");
+}
+
+int sbpSendHeader64(socket_t sock, int32_t kind, uint64_t len){
+    uint64_t buf[2];
+    sbpEncodeHeader((char*)&buf,kind,len);
+    if (sbpSendDirect(sock,&buf,12)!=0) {
+        fprintf(stderr,"SBP error sending header\n");
         return 1;
     }
     return 0;
@@ -192,72 +472,46 @@ int sbpSend8_64(socket_t sock,void* start,uint64_t len){
 }
 
 int sbpSendDirect(socket_t sock,void* start,uint64_t len){
-    if (write(sock,start,(size_t)len)!=len) {
-        perror("SBP error sending data");
+    struct iovec iov;
+    iov.iov_base=start;
+    iov.iov_len=(size_t)len;
+    if (sbpWriteAllV(sock,&iov,1)!=0) {
+        fprintf(stderr,"SBP error sending data\n");
         return 1;
     }
     return 0;
 }
 
-int sbpSendInvert4(socket_t sock,uint64_t len, void* start){
-    const size_t bufSize=endian_buf_size+4;
-    uint32_t _buf[endian_buf_size/4];
-    char* buf=(char*)&_buf;
-    char* bufPos=buf;
-    char* bufEnd=bufPos+bufSize-4;
+int sbpSendInvert4(socket_t sock,void* start,uint64_t len){
+    uint32_t _buf[swap_buf_size/4];
     char* pos=(char*)start;
     char* end=pos+len;
     while (pos<end){
-        bufPos[3]=pos[0];
-        bufPos[2]=pos[1];
-        bufPos[1]=pos[2];
-        bufPos[0]=pos[3];
-        bufPos+=4;
-        pos+=4;
-        if (bufPos>=bufEnd){
-            if (write(sock,buf,bufPos-buf)!=bufPos-buf) {
-                perror("SBP error sending byte inverted 4 byte data");
-                return 1;
-            }
-            bufPos=buf;
+        size_t toSend=(size_t)(end-pos);
+        if (toSend>swap_buf_size) toSend=swap_buf_size;
+        sbpCopyInvert4(_buf,pos,toSend);
+        if (sbpSendDirect(sock,_buf,toSend)!=0) {
+            fprintf(stderr,"SBP error sending byte inverted 4 byte data\n");
+            return 1;
         }
-    }
-    if (write(sock,buf,bufPos-buf)!=bufPos-buf) {
-        perror("SBP error sending last byte inverted 4 byte data");
-        return 2;
+        pos+=toSend;
     }
     return 0;
 }
 
-int sbpSendInvert8(int sock, uint64_t* start,uint64_t len){
-    const int bufSize=endian_buf_size+8;
-    uint64_t _buf[bufSize/8];
-    char* buf=(char*)&_buf;
-    char* bufPos=buf;
-    char* bufEnd=bufPos+bufSize-8;
-    char* pos=(char*)start,*end=pos+(size_t)len;
+int sbpSendInvert8(socket_t sock,void* start,uint64_t len){
+    uint64_t _buf[swap_buf_size/8];
+    char* pos=(char*)start;
+    char* end=pos+len;
     while (pos<end){
-        bufPos[7]=pos[0];
-        bufPos[6]=pos[1];
-        bufPos[5]=pos[2];
-        bufPos[4]=pos[3];
-        bufPos[3]=pos[4];
-        bufPos[2]=pos[5];
-        bufPos[1]=pos[6];
-        bufPos[0]=pos[7];
-        bufPos+=8;
-        pos+=8;
-        if (bufPos>=bufEnd){
-            if (write(sock,buf,bufPos-buf)!=bufPos-buf) {
-                perror("SBP error sending byte inverted 8 byte data");
-                return 1;
-            }
-            bufPos=buf;
+        size_t toSend=(size_t)(end-pos);
+        if (toSend>swap_buf_size) toSend=swap_buf_size;
+        sbpCopyInvert8(_buf,pos,toSend);
+        if (sbpSendDirect(sock,_buf,toSend)!=0) {
+            fprintf(stderr,"SBP error sending byte inverted 8 byte data\n");
+            return 1;
         }
-    }
-    if (write(sock,buf,bufPos-buf)!=bufPos-buf) {
-        perror("SBP error sending last byte inverted 4 byte data");
-        return 2;
+        pos+=toSend;
     }
     return 0;
 }
@@ -322,6 +576,7 @@ void sbpsendcp64n__(int *ierr,socket_t*sock,char*p,uint64_t len){
 
 int sbpSendInt4Array64(socket_t sock, void*p, uint64_t len){
     uint64_t byteLen=4UL*len;
+    if (sbpPackUse(sock,byteLen)) return sbpSendPacked64(sock,kind_int_packed,p,byteLen);
     if (sbpSendHeader64(sock,kind_int_small,byteLen)!=0) return 3;
     return sbpSend4_64(sock,p,byteLen);
 }
@@ -353,6 +608,7 @@ void sbpsendip64__(int*ierr,socket_t*sock,void*p,uint64_t*len){
 
 int sbpSendInt4Array32(socket_t sock, void*p, uint32_t len){
     uint64_t byteLen=4UL*len;
+    if (sbpPackUse(sock,byteLen)) return sbpSendPacked64(sock,kind_int_packed,p,byteLen);
     if (sbpSendHeader64(sock,kind_int_small,byteLen)!=0) return 3;
     return sbpSend4_64(sock,p,byteLen);
 }
@@ -384,6 +640,7 @@ void sbpsendip32__(int*ierr,socket_t*sock,void*p,uint32_t*len){
 
 int sbpSendDoubleArray64(socket_t sock, void*p, uint64_t len){
     uint64_t byteLen=8UL*len;
+    if (sbpPackUse(sock,byteLen)) return sbpSendPacked64(sock,kind_double_packed,p,byteLen);
     if (sbpSendHeader64(sock,kind_double_small,byteLen)!=0) return 3;
     return sbpSend8_64(sock,p,byteLen);
 }
@@ -400,6 +657,7 @@ void sbpsendd64__(int*ierr,socket_t*sock,void*p,uint64_t* len){
 
 int sbpSendDoubleArray32(socket_t sock, void*p, uint32_t len){
     uint64_t byteLen=8UL*len;
+    if (sbpPackUse(sock,byteLen)) return sbpSendPacked64(sock,kind_double_packed,p,byteLen);
     if (sbpSendHeader64(sock,kind_double_small,byteLen)!=0) return 3;
     return sbpSend8_64(sock,p,byteLen);
 }
@@ -429,35 +687,281 @@ void sbpsenddp32__(int*ierr,socket_t*sock,void*p,uint32_t* len){
     *ierr=sbpSendDoublePiece32(*sock,p,*len);
 }
 
+//////// batched sending ////////
+
+int sbpBatchInit(sbp_batch **batch,socket_t sock){
+    sbp_batch *b=(sbp_batch*)malloc(sizeof(sbp_batch));
+    *batch=NULL;
+    if (!b) return 1;
+    memset(b,0,sizeof(sbp_batch));
+    b->sock=sock;
+    b->buf=(char*)malloc(batch_initial_buf);
+    b->entries=(struct sbp_batch_entry*)malloc(batch_initial_entries*sizeof(struct sbp_batch_entry));
+    if (!b->buf || !b->entries){
+        free(b->buf);
+        free(b->entries);
+        free(b);
+        return 1;
+    }
+    b->bufCapacity=batch_initial_buf;
+    b->entriesCapacity=batch_initial_entries;
+    *batch=b;
+    return 0;
+}
+/// f77 interface
+void sbpbatchinit(int *ierr,sbp_batch **batch,socket_t *sock){
+    *ierr=sbpBatchInit(batch,*sock);
+}
+void sbpbatchinit_(int *ierr,sbp_batch **batch,socket_t *sock){
+    *ierr=sbpBatchInit(batch,*sock);
+}
+void sbpbatchinit__(int *ierr,sbp_batch **batch,socket_t *sock){
+    *ierr=sbpBatchInit(batch,*sock);
+}
+
+int sbpBatchFree(sbp_batch *batch){
+    if (!batch) return 0;
+    free(batch->buf);
+    free(batch->entries);
+    free(batch->iov);
+    free(batch);
+    return 0;
+}
+/// f77 interface
+void sbpbatchfree(int *ierr,sbp_batch **batch){
+    *ierr=sbpBatchFree(*batch);
+    *batch=NULL;
+}
+void sbpbatchfree_(int *ierr,sbp_batch **batch){
+    sbpbatchfree(ierr,batch);
+}
+void sbpbatchfree__(int *ierr,sbp_batch **batch){
+    sbpbatchfree(ierr,batch);
+}
+
+/// reserves len bytes in the batch buffer and returns a pointer to them (NULL on failure)
+/// the memory is valid only until the next reserve
+char *sbpBatchReserve(sbp_batch *batch,size_t len){
+    struct sbp_batch_entry *last;
+    if (batch->bufLen+len>batch->bufCapacity){
+        size_t newCapacity=2*batch->bufCapacity;
+        char *newBuf;
+        if (newCapacity<batch->bufLen+len) newCapacity=batch->bufLen+len;
+        newBuf=(char*)realloc(batch->buf,newCapacity);
+        if (!newBuf) return NULL;
+        batch->buf=newBuf;
+        batch->bufCapacity=newCapacity;
+    }
+    last=batch->entries+batch->nEntries-1;
+    if (batch->nEntries>0 && last->ptr==NULL && last->offset+last->len==batch->bufLen){
+        last->len+=len; // contiguous with the previous owned piece
+    } else {
+        if (batch->nEntries==batch->entriesCapacity){
+            size_t newCapacity=2*batch->entriesCapacity;
+            struct sbp_batch_entry *newEntries=(struct sbp_batch_entry*)realloc(batch->entries,
+                newCapacity*sizeof(struct sbp_batch_entry));
+            if (!newEntries) return NULL;
+            batch->entries=newEntries;
+            batch->entriesCapacity=newCapacity;
+        }
+        last=batch->entries+batch->nEntries;
+        last->ptr=NULL;
+        last->offset=batch->bufLen;
+        last->len=len;
+        ++batch->nEntries;
+    }
+    batch->bufLen+=len;
+    return batch->buf+batch->bufLen-len;
+}
+
+/// adds a reference to user memory to the batch
+int sbpBatchAddRef(sbp_batch *batch,void *p,size_t len){
+    struct sbp_batch_entry *entry;
+    if (batch->nEntries==batch->entriesCapacity){
+        size_t newCapacity=2*batch->entriesCapacity;
+        struct sbp_batch_entry *newEntries=(struct sbp_batch_entry*)realloc(batch->entries,
+            newCapacity*sizeof(struct sbp_batch_entry));
+        if (!newEntries) return 1;
+        batch->entries=newEntries;
+        batch->entriesCapacity=newCapacity;
+    }
+    entry=batch->entries+batch->nEntries;
+    entry->ptr=(char*)p;
+    entry->offset=0;
+    entry->len=len;
+    ++batch->nEntries;
+    return 0;
+}
+
+int sbpBatchAddHeader64(sbp_batch *batch,int32_t kind,uint64_t len){
+    char *pos=sbpBatchReserve(batch,12);
+    if (!pos) return 1;
+    sbpEncodeHeader(pos,kind,len);
+    return 0;
+}
+
+/// adds len bytes of data made of elements of elSize bytes to the batch
+/// small payloads and payloads that need byte swapping are copied, larger ones
+/// are just referenced and have to stay valid until the next sbpBatchFlush
+int sbpBatchAddPiece(sbp_batch *batch,void *p,uint64_t len,int elSize){
+    char *pos;
+    if (len==0) return 0;
+    if (len>batch_inline_size && (!swapBits || elSize==1)){
+        return sbpBatchAddRef(batch,p,(size_t)len);
+    }
+    pos=sbpBatchReserve(batch,(size_t)len);
+    if (!pos) return 1;
+    if (swapBits && elSize==4){
+        sbpCopyInvert4(pos,p,len);
+    } else if (swapBits && elSize==8){
+        sbpCopyInvert8(pos,p,len);
+    } else {
+        memcpy(pos,p,(size_t)len);
+    }
+    return 0;
+}
+
+/// adds a header and its payload, if the payload cannot be added the header is removed
+/// again, so that a failed add leaves the batch as it was
+static int sbpBatchAddMessage(sbp_batch *batch,int32_t kind,void *p,uint64_t len,int elSize){
+    size_t bufLen=batch->bufLen,nEntries=batch->nEntries,lastLen=0;
+    int err;
+    if (nEntries>0) lastLen=batch->entries[nEntries-1].len;
+    if (sbpBatchAddHeader64(batch,kind,len)!=0) return 3;
+    err=sbpBatchAddPiece(batch,p,len,elSize);
+    if (err!=0){
+        batch->bufLen=bufLen;
+        batch->nEntries=nEntries;
+        if (nEntries>0) batch->entries[nEntries-1].len=lastLen; // the header might extend it
+    }
+    return err;
+}
+
+int sbpBatchAddChars32(sbp_batch *batch,char* p,uint32_t len){
+    return sbpBatchAddMessage(batch,kind_char,p,(uint64_t)len,1);
+}
+/// f77 interface
+void sbpbatchc32n(int *ierr,sbp_batch **batch,char*p,uint32_t len){
+    *ierr=sbpBatchAddChars32(*batch,p,len);
+}
+void sbpbatchc32n_(int *ierr,sbp_batch **batch,char*p,uint32_t len){
+    *ierr=sbpBatchAddChars32(*batch,p,len);
+}
+void sbpbatchc32n__(int *ierr,sbp_batch **batch,char*p,uint32_t len){
+    *ierr=sbpBatchAddChars32(*batch,p,len);
+}
+
+int sbpBatchAddChars64(sbp_batch *batch,char* p,uint64_t len){
+    return sbpBatchAddMessage(batch,kind_char,p,len,1);
+}
+/// f77 interface
+void sbpbatchc64n(int *ierr,sbp_batch **batch,char*p,uint64_t len){
+    *ierr=sbpBatchAddChars64(*batch,p,len);
+}
+void sbpbatchc64n_(int *ierr,sbp_batch **batch,char*p,uint64_t len){
+    *ierr=sbpBatchAddChars64(*batch,p,len);
+}
+void sbpbatchc64n__(int *ierr,sbp_batch **batch,char*p,uint64_t len){
+    *ierr=sbpBatchAddChars64(*batch,p,len);
+}
+
+int sbpBatchAddInt4Array64(sbp_batch *batch,void *p,uint64_t len){
+    return sbpBatchAddMessage(batch,kind_int_small,p,4UL*len,4);
+}
+/// f77 interface
+void sbpbatchi64(int*ierr,sbp_batch **batch,void*p,uint64_t*len){
+    *ierr=sbpBatchAddInt4Array64(*batch,p,*len);
+}
+void sbpbatchi64_(int*ierr,sbp_batch **batch,void*p,uint64_t*len){
+    *ierr=sbpBatchAddInt4Array64(*batch,p,*len);
+}
+void sbpbatchi64__(int*ierr,sbp_batch **batch,void*p,uint64_t*len){
+    *ierr=sbpBatchAddInt4Array64(*batch,p,*len);
+}
+
+int sbpBatchAddInt4Array32(sbp_batch *batch,void *p,uint32_t len){
+    return sbpBatchAddInt4Array64(batch,p,(uint64_t)len);
+}
+/// f77 interface
+void sbpbatchi32(int*ierr,sbp_batch **batch,void*p,uint32_t*len){
+    *ierr=sbpBatchAddInt4Array32(*batch,p,*len);
+}
+void sbpbatchi32_(int*ierr,sbp_batch **batch,void*p,uint32_t*len){
+    *ierr=sbpBatchAddInt4Array32(*batch,p,*len);
+}
+void sbpbatchi32__(int*ierr,sbp_batch **batch,void*p,uint32_t*len){
+    *ierr=sbpBatchAddInt4Array32(*batch,p,*len);
+}
+
+int sbpBatchAddDoubleArray64(sbp_batch *batch,void *p,uint64_t len){
+    return sbpBatchAddMessage(batch,kind_double_small,p,8UL*len,8);
+}
+/// f77 interface
+void sbpbatchd64(int*ierr,sbp_batch **batch,void*p,uint64_t*len){
+    *ierr=sbpBatchAddDoubleArray64(*batch,p,*len);
+}
+void sbpbatchd64_(int*ierr,sbp_batch **batch,void*p,uint64_t*len){
+    *ierr=sbpBatchAddDoubleArray64(*batch,p,*len);
+}
+void sbpbatchd64__(int*ierr,sbp_batch **batch,void*p,uint64_t*len){
+    *ierr=sbpBatchAddDoubleArray64(*batch,p,*len);
+}
+
+int sbpBatchAddDoubleArray32(sbp_batch *batch,void *p,uint32_t len){
+    return sbpBatchAddDoubleArray64(batch,p,(uint64_t)len);
+}
+/// f77 interface
+void sbpbatchd32(int*ierr,sbp_batch **batch,void*p,uint32_t*len){
+    *ierr=sbpBatchAddDoubleArray32(*batch,p,*len);
+}
+void sbpbatchd32_(int*ierr,sbp_batch **batch,void*p,uint32_t*len){
+    *ierr=sbpBatchAddDoubleArray32(*batch,p,*len);
+}
+void sbpbatchd32__(int*ierr,sbp_batch **batch,void*p,uint32_t*len){
+    *ierr=sbpBatchAddDoubleArray32(*batch,p,*len);
+}
+
+int sbpBatchFlush(sbp_batch *batch){
+    size_t i;
+    int err;
+    if (batch->nEntries==0) return 0;
+    if (batch->iovCapacity<batch->nEntries){
+        struct iovec *newIov=(struct iovec*)realloc(batch->iov,batch->nEntries*sizeof(struct iovec));
+        if (!newIov) return 1;
+        batch->iov=newIov;
+        batch->iovCapacity=batch->nEntries;
+    }
+    for (i=0;i<batch->nEntries;++i){
+        struct sbp_batch_entry *entry=batch->entries+i;
+        batch->iov[i].iov_base=(entry->ptr)?entry->ptr:(batch->buf+entry->offset);
+        batch->iov[i].iov_len=entry->len;
+    }
+    err=sbpWriteAllV(batch->sock,batch->iov,batch->nEntries);
+    batch->nEntries=0;
+    batch->bufLen=0;
+    if (err!=0){
+        fprintf(stderr,"SBP error flushing batch\n");
+        return 2;
+    }
+    return 0;
+}
+/// f77 interface
+void sbpbatchflush(int *ierr,sbp_batch **batch){
+    *ierr=sbpBatchFlush(*batch);
+}
+void sbpbatchflush_(int *ierr,sbp_batch **batch){
+    *ierr=sbpBatchFlush(*batch);
+}
+void sbpbatchflush__(int *ierr,sbp_batch **batch){
+    *ierr=sbpBatchFlush(*batch);
+}
+
 
 //////// receiving ///////
 
-int sbpReadHeader64(socket_t sock, uint32_t *kind, uint64_t *len){
-    uint64_t buf[2],nodata=0;
-    char* bufPos=(char*)&buf,*endBuf=bufPos+12;
+/// decodes the 12 bytes header in buf
+void sbpDecodeHeader(char *bufPos, uint32_t *kind, uint64_t *len){
     char* pos;
-    while (bufPos<endBuf){
-        size_t toRead=(size_t)(endBuf-bufPos);
-        size_t readB=recv(sock,bufPos,toRead,MSG_WAITALL);
-        if (readB==0){
-            if (++nodata>10000){
-                fprintf(stderr,"partial read %ld/%ld:",bufPos-((char*)&buf),toRead);
-                for (pos=(char*)&buf;pos<bufPos;++pos)
-                    fprintf(stderr," %02x",*pos);
-                fprintf(stderr,"\n");
-                perror("SBP no data in receiving header");
-                return 1;
-            }
-        } else {
-            nodata=0;
-        }
-        if (readB==-(size_t)1){
-            perror("SBP EOF in receiving header");
-            return 2;
-        }
-        bufPos+=readB;
-    }
-    bufPos=(char*)&buf;
     if (swapBits){
         pos=(char*)kind;
         pos[0]=bufPos[3];
@@ -475,13 +979,264 @@ int sbpReadHeader64(socket_t sock, uint32_t *kind, uint64_t *len){
         pos[6]=bufPos[1];
         pos[7]=bufPos[0];
     } else {
-        *kind=*((uint32_t*)bufPos);
-        bufPos+=4;
-        *len=*((uint64_t*)bufPos);
+        memcpy(kind,bufPos,4);
+        memcpy(len,bufPos+4,8);
+    }
+}
+
+/// reads exactly len bytes from the socket (without going through the reader)
+int sbpRecvAll(socket_t sock,void* start,uint64_t len){
+    char*pos=start;
+    char*end=((char*)start)+len;
+    while(pos!=end){
+        ssize_t readB=recv(sock,pos,end-pos,MSG_WAITALL);
+        if (readB==0){
+            // orderly shutdown of the peer, retrying would just spin
+            fprintf(stderr,"SBP partial read %ld, connection closed\n",(long)(pos-((char*)start)));
+            return 6;
+        }
+        if (readB<0) {
+            if (errno==EINTR) continue;
+            if (errno==EAGAIN || errno==EWOULDBLOCK){
+                struct pollfd pfd;
+                pfd.fd=sock;
+                pfd.events=POLLIN;
+                pfd.revents=0;
+                if (poll(&pfd,1,-1)<0 && errno!=EINTR){
+                    perror("SBP error waiting for data");
+                    return 5;
+                }
+                continue;
+            }
+            perror("SBP EOF error reading data");
+            return 5;
+        }
+        pos+=readB;
+    }
+    return 0;
+}
+
+/// returns the reader attached to the given socket, or NULL
+sbp_reader *sbpReaderFor(socket_t sock){
+    sbp_reader_table *table=__atomic_load_n(&sbpReaders,__ATOMIC_ACQUIRE);
+    if (table && sock>=0 && (size_t)sock<table->size){
+        return __atomic_load_n(&table->readers[sock],__ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
+
+int sbpReaderAttach(socket_t sock,uint64_t bufSize){
+    sbp_reader *r;
+    if (sock<0) return 1;
+    if (bufSize==0) bufSize=reader_default_size;
+    if (bufSize<64) bufSize=64;
+    if (sbpReaderFor(sock)!=NULL) return 0; // already buffered
+    r=(sbp_reader*)malloc(sizeof(sbp_reader));
+    if (!r) return 2;
+    r->buf=(char*)malloc((size_t)bufSize);
+    if (!r->buf){
+        free(r);
+        return 2;
+    }
+    r->sock=sock;
+    r->start=0;
+    r->end=0;
+    r->capacity=(size_t)bufSize;
+    pthread_mutex_lock(&sbpReadersLock);
+    if (!sbpReaders || (size_t)sock>=sbpReaders->size){
+        size_t oldSize=(sbpReaders)?sbpReaders->size:0;
+        size_t newSize=(oldSize>0)?2*oldSize:64,i;
+        sbp_reader_table *newReaders;
+        while (newSize<=(size_t)sock) newSize*=2;
+        newReaders=(sbp_reader_table*)malloc(sizeof(sbp_reader_table)+newSize*sizeof(sbp_reader*));
+        if (!newReaders){
+            pthread_mutex_unlock(&sbpReadersLock);
+            free(r->buf);
+            free(r);
+            return 2;
+        }
+        newReaders->size=newSize;
+        for (i=0;i<oldSize;++i) newReaders->readers[i]=sbpReaders->readers[i];
+        for (i=oldSize;i<newSize;++i) newReaders->readers[i]=NULL;
+        __atomic_store_n(&sbpReaders,newReaders,__ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&sbpReaders->readers[sock],r,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sbpReadersLock);
+    return 0;
+}
+/// f77 interface
+void sbpreaderattach(int *ierr,socket_t *sock,uint64_t *bufSize){
+    *ierr=sbpReaderAttach(*sock,*bufSize);
+}
+void sbpreaderattach_(int *ierr,socket_t *sock,uint64_t *bufSize){
+    *ierr=sbpReaderAttach(*sock,*bufSize);
+}
+void sbpreaderattach__(int *ierr,socket_t *sock,uint64_t *bufSize){
+    *ierr=sbpReaderAttach(*sock,*bufSize);
+}
+
+int sbpReaderDetach(socket_t sock){
+    sbp_reader *r=sbpReaderFor(sock);
+    int res=0;
+    if (!r) return 0;
+    if (r->end!=r->start){
+        fprintf(stderr,"SBP detaching reader of socket %d discards %ld buffered bytes\n",
+            sock,(long)(r->end-r->start));
+        res=1;
     }
+    pthread_mutex_lock(&sbpReadersLock);
+    __atomic_store_n(&sbpReaders->readers[sock],NULL,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sbpReadersLock);
+    free(r->buf);
+    free(r);
+    return res;
+}
+/// f77 interface
+void sbpreaderdetach(int *ierr,socket_t *sock){
+    *ierr=sbpReaderDetach(*sock);
+}
+void sbpreaderdetach_(int *ierr,socket_t *sock){
+    *ierr=sbpReaderDetach(*sock);
+}
+void sbpreaderdetach__(int *ierr,socket_t *sock){
+    *ierr=sbpReaderDetach(*sock);
+}
+
+uint64_t sbpReaderBuffered(socket_t sock){
+    sbp_reader *r=sbpReaderFor(sock);
+    if (!r) return 0;
+    return (uint64_t)(r->end-r->start);
+}
+
+/// gives access to (at most maxLen) data already buffered for sock, and consumes it
+/// returns the number of bytes available at *data
+uint64_t sbpReaderConsume(socket_t sock,char **data,uint64_t maxLen){
+    sbp_reader *r=sbpReaderFor(sock);
+    size_t n;
+    if (!r) return 0;
+    n=r->end-r->start;
+    if (n>maxLen) n=(size_t)maxLen;
+    *data=r->buf+r->start;
+    r->start+=n;
+    return (uint64_t)n;
+}
+
+/// ensures that at least minAvail (<=capacity) bytes are in the buffer, reading
+/// as much as is available from the socket
+int sbpReaderFill(sbp_reader *r,size_t minAvail){
+    if (r->start==r->end){
+        r->start=0;
+        r->end=0;
+    } else if (r->start>0 && (r->capacity-r->start<minAvail || r->capacity-r->end<r->capacity/2)){
+        memmove(r->buf,r->buf+r->start,r->end-r->start);
+        r->end-=r->start;
+        r->start=0;
+    }
+    while (r->end-r->start<minAvail){
+        ssize_t readB=recv(r->sock,r->buf+r->end,r->capacity-r->end,0);
+        if (readB<0){
+            if (errno==EINTR) continue;
+            if (errno==EAGAIN || errno==EWOULDBLOCK){
+                struct pollfd pfd;
+                pfd.fd=r->sock;
+                pfd.events=POLLIN;
+                pfd.revents=0;
+                if (poll(&pfd,1,-1)<0 && errno!=EINTR){
+                    perror("SBP error waiting for data");
+                    return 5;
+                }
+                continue;
+            }
+            perror("SBP error filling read buffer");
+            return 5;
+        }
+        if (readB==0){
+            fprintf(stderr,"SBP EOF with %ld/%ld bytes buffered\n",(long)(r->end-r->start),(long)minAvail);
+            return 6;
+        }
+        r->end+=(size_t)readB;
+    }
+    return 0;
+}
+
+/// reads len bytes through the reader, large reads go directly to the destination
+int sbpReaderRead(sbp_reader *r,void *dst,uint64_t len){
+    char *pos=(char*)dst;
+    size_t avail=r->end-r->start;
+    size_t n=(len<avail)?(size_t)len:avail;
+    int err;
+    memcpy(pos,r->buf+r->start,n);
+    r->start+=n;
+    pos+=n;
+    len-=n;
+    if (len==0) return 0;
+    if (len>=r->capacity/2) return sbpRecvAll(r->sock,pos,len);
+    if ((err=sbpReaderFill(r,(size_t)len))!=0) return err;
+    memcpy(pos,r->buf+r->start,(size_t)len);
+    r->start+=(size_t)len;
+    return 0;
+}
+
+/// skips len bytes through the reader
+int sbpReaderSkip(sbp_reader *r,uint64_t len){
+    while (len>0){
+        size_t avail=r->end-r->start,n;
+        int err;
+        if (avail==0){
+            if ((err=sbpReaderFill(r,1))!=0) return err;
+            avail=r->end-r->start;
+        }
+        n=(len<avail)?(size_t)len:avail;
+        r->start+=n;
+        len-=n;
+    }
+    return 0;
+}
+
+static int sbpReadHeader64Once(socket_t sock, uint32_t *kind, uint64_t *len){
+    uint64_t buf[2];
+    int err;
+    sbp_reader *r=sbpReaderFor(sock);
+    sbp_shm *shm=sbpShmFor(sock);
+    if (shm){
+        if (sbpShmRead(shm,buf,12)!=0){
+            perror("SBP EOF in receiving header");
+            return 2;
+        }
+        sbpDecodeHeader((char*)&buf,kind,len);
+        return 0;
+    }
+    if (r){
+        if (r->end-r->start<12 && sbpReaderFill(r,12)!=0){
+            perror("SBP EOF in receiving header");
+            return 2;
+        }
+        sbpDecodeHeader(r->buf+r->start,kind,len);
+        r->start+=12;
+        return 0;
+    }
+    err=sbpRecvAll(sock,buf,12);
+    if (err==6){
+        fprintf(stderr,"SBP no data in receiving header\n");
+        return 1;
+    } else if (err){
+        perror("SBP EOF in receiving header");
+        return 2;
+    }
+    sbpDecodeHeader((char*)&buf,kind,len);
     //printf("read header kind %d len %d\n",*kind,(int)*len);
     return 0;
 }
+
+/// reads the header of the next message, handshakes arriving late (after sbpAccept
+/// or sbpConnectTo gave up waiting) are handled here and never returned
+int sbpReadHeader64(socket_t sock, uint32_t *kind, uint64_t *len){
+    int err;
+    while ((err=sbpReadHeader64Once(sock,kind,len))==0 && *kind==kind_handshake){
+        if ((err=sbpHandshakeLate(sock,*len))!=0) return err;
+    }
+    return err;
+}
 // f77 bindings
 void sbpreadh64(int *ierr,socket_t *sock, uint32_t *kind, uint64_t *length){
     *ierr=sbpReadHeader64(*sock,kind,length);
@@ -546,25 +1301,17 @@ int sbpRead8_64(socket_t sock,void* start,uint64_t len){
 }
 
 int sbpReadDirect(socket_t sock,void* start,uint64_t len){
-    char*pos=start;
-    char*end=((char*)start)+len;
-    int nodata=0;
-    while(pos!=end){
-        size_t readB=recv(sock,pos,end-pos,MSG_WAITALL);
-        if (readB==0){
-            if (++nodata>10000){
-                fprintf(stderr,"SBP partial read %ld, no data\n",pos-((char*)start));
-                return 6;
-            }
-        } else {
-            nodata=0;
-        }
-        if (readB==-(size_t)1) {
-            perror("SBP EOF error reading data");
-            return 5;
-        }
-        pos+=readB;
+    int err;
+    sbp_reader *r=sbpReaderFor(sock);
+    sbp_shm *shm=sbpShmFor(sock);
+    if (shm){
+        err=sbpShmRead(shm,start,len);
+    } else if (r){
+        err=sbpReaderRead(r,start,len);
+    } else {
+        err=sbpRecvAll(sock,start,len);
     }
+    if (err) return err;
     /*{
         uint64_t i;
         printf("read:");
@@ -581,6 +1328,10 @@ int sbpSkip(socket_t sock,uint64_t len){
     const size_t bufSize=endian_buf_size;
     char buf[bufSize];
     uint64_t readBTot=0;
+    sbp_reader *r=sbpReaderFor(sock);
+    sbp_shm *shm=sbpShmFor(sock);
+    if (shm) return sbpShmRead(shm,NULL,len);
+    if (r) return sbpReaderSkip(r,len);
     while(readBTot!=len){
         uint64_t toRead=len-readBTot;
         if (toRead>bufSize) toRead=bufSize;
@@ -598,92 +1349,18 @@ int sbpSkip(socket_t sock,uint64_t len){
     return 0;
 }
 
-int sbpReadInvert4(socket_t sock,uint64_t len, void* start){
-    const size_t bufSize=endian_buf_size+4;
-    uint32_t _buf[bufSize/4];
-    char* bufPos=(char*)&_buf;
-    char *pos=(char*)start;
-    char* posEnd=pos+len;
-    while (pos!=posEnd){
-        char *bufPos2;
-        size_t toRead=posEnd-pos;
-        if (toRead>bufSize-4) toRead=bufSize-4;
-        size_t readB=read(sock,bufPos,toRead);
-        if (readB==-(size_t)1) {
-            perror("SBP EOF error reading data");
-            return 5;
-        }
-        if (readB==0) {
-            perror("SBP error no data read");
-            return 6;
-        }
-        char*end=bufPos+readB;
-        if (end >= ((char*)&_buf)+4){
-            end-=4;
-            for (bufPos=(char*)&_buf;bufPos<end;bufPos+=4){
-                pos[0]=bufPos[3];
-                pos[1]=bufPos[2];
-                pos[2]=bufPos[1];
-                pos[3]=bufPos[0];
-                pos+=4;
-            }
-            end+=4;
-        }
-        bufPos2=(char*)&_buf;
-        while (bufPos<end){
-            *bufPos2=*bufPos;
-            ++bufPos;++bufPos2;
-        }
-        bufPos=bufPos2;
-    }
-    return 0;
+/// reads directly in the destination array and inverts the bytes there
+int sbpReadInvert4(socket_t sock,void* start,uint64_t len){
+    int err=sbpReadDirect(sock,start,len);
+    if (err==0) sbpInvert4InPlace(start,len);
+    return err;
 }
 
-int sbpReadInvert8(int sock, uint64_t* start,uint64_t len){
-    const int bufSize=endian_buf_size+8;
-    uint64_t _buf[bufSize/8];
-    char* bufPos=(char*)&_buf;
-    char* bufEnd=bufPos+bufSize-8;
-    char *pos=(char*)start;
-    char* posEnd=pos+len;
-    
-    while (pos!=posEnd){
-        char *bufPos2;
-        size_t toRead=posEnd-pos;
-        if (toRead>bufSize-8) toRead=bufSize-8;
-        size_t readB=read(sock,bufPos,toRead);
-        if (readB==-(size_t)1) {
-            perror("SBP EOF error reading data");
-            return 5;
-        }
-        if (readB==0) {
-            perror("SBP error no data read");
-            return 6;
-        }
-        char*end=bufPos+readB;
-        if (end>(char*)(&_buf[1])){
-            end-=8;
-            for (bufPos=(char*)&_buf;bufPos<end;bufPos+=8){
-                pos[0]=bufPos[7];
-                pos[1]=bufPos[6];
-                pos[2]=bufPos[5];
-                pos[3]=bufPos[4];
-                pos[4]=bufPos[3];
-                pos[5]=bufPos[2];
-                pos[6]=bufPos[1];
-                pos[7]=bufPos[0];
-                pos+=8;
-            }
-            end+=8;
-        }
-        bufPos2=(char*)&_buf;
-        while (bufPos<end){
-            *bufPos2=*bufPos;
-            ++bufPos;++bufPos2;
-        }
-        bufPos=bufPos2;
-    }
-    return 0;
+/// reads directly in the destination array and inverts the bytes there
+int sbpReadInvert8(socket_t sock,void* start,uint64_t len){
+    int err=sbpReadDirect(sock,start,len);
+    if (err==0) sbpInvert8InPlace(start,len);
+    return err;
 }
 
 ///////
@@ -784,6 +1461,7 @@ int sbpReadInt4Array64(socket_t sock, void*p, uint64_t len){
         //sbpSkip(sock,rcvLen);
         return 15;
     }
+    if (kind==kind_int_packed) return sbpReadPacked64(sock,kind,p,rcvLen);
     if (kind!=kind_int_small) {
         //sbpRead4_64(sock,p,rcvLen);
         return 14;
@@ -853,6 +1531,7 @@ int sbpReadDoubleArray64(socket_t sock, void*p, uint64_t len){
         // sbpSkip(sock,rcvLen);
         return 15;
     }
+    if (kind==kind_double_packed) return sbpReadPacked64(sock,kind,p,byteLen);
     if (kind!=kind_double_small) {
         //sbpRead8_64(sock,p,byteLen);
         return 14;
@@ -961,7 +1640,7 @@ int sbpConnectTo32(socket_t *sock, char*address,uint32_t len){
     }
     
     socket_t s=-1;
-    for (addrAtt=addressInfo;addrAtt;addrAtt->ai_next){
+    for (addrAtt=addressInfo;addrAtt;addrAtt=addrAtt->ai_next){
         s = socket(addrAtt->ai_family, addrAtt->ai_socktype, addrAtt->ai_protocol);
         if (s<0) continue;
         if (connect(s, addrAtt->ai_addr, addrAtt->ai_addrlen) != 0) {
@@ -977,6 +1656,7 @@ int sbpConnectTo32(socket_t *sock, char*address,uint32_t len){
         return 23;
     }
     *sock=s;
+    if (sbpHandshakeConnect(s)!=0) return 24;
     return 0;
 }
 /// f77 interface
@@ -1086,11 +1766,6 @@ int sbpListenForService32(socket_t *sock,char *service,uint32_t len){
         return 1; // no bind successful
     }
     lSock.externalId=lSock.socktable[0];
-    FD_ZERO(&lSock.selectSet);
-    for (isock=0;isock<lSock.nSockets;++isock){
-        FD_SET(lSock.socktable[isock],&lSock.selectSet);
-        if (lSock.maxDesc<lSock.socktable[isock]) lSock.maxDesc=lSock.socktable[isock];
-    }
     lSock2=(struct sbp_listening_sockets*)malloc(sizeof(lSock));
     memcpy(lSock2,&lSock,sizeof(lSock));
     lSock2->next=sbpListeningSockets;
@@ -1137,7 +1812,7 @@ int sbpClose(socket_t sock,int what){
     }else {
         how=SHUT_RDWR;
     }
-    for (lSOld=lS=sbpListeningSockets;lS;lS->next){
+    for (lSOld=lS=sbpListeningSockets;lS;lS=lS->next){
         if (lS->externalId==sock){
             int i;
             if (lSOld==lS){
@@ -1162,6 +1837,13 @@ int sbpClose(socket_t sock,int what){
         }
         lSOld=lS; 
     }
+    if (how!=SHUT_WR) sbpReaderDetach(sock);
+    if (how==SHUT_RDWR) sbpPackSetPeer(sock,0);
+    if (sbpShmFor(sock)){
+        // the socket stays fully open until the end, as it signals that the peer is alive
+        sbpShmClose(sock,(how==SHUT_RD)?0:((how==SHUT_WR)?1:2));
+        if (how!=SHUT_RDWR) return 0;
+    }
     if (shutdown(sock,how)!=0) {
         perror("SBP error shutting down the socket");
         return 3;
@@ -1183,71 +1865,110 @@ void sbpclose__(int *ierr,socket_t *sock,int *what){
     *ierr=sbpClose(*sock,*what);
 }
 
+/// stores in socks the (at most maxSocks) system sockets behind the listening socket sock
+/// and returns their number (-1 if sock is not a listening socket)
+int sbpListeningSocketsOf(socket_t sock,socket_t *socks,int maxSocks){
+    struct sbp_listening_sockets *lS;
+    int i;
+    for (lS=sbpListeningSockets;lS;lS=lS->next){
+        if (lS->externalId==sock){
+            for (i=0;i<lS->nSockets && i<maxSocks;++i){
+                socks[i]=lS->socktable[i];
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+/// writes "host port" of the given address to addrStr, returns 1 if addrStr could not
+/// be fully initialized (either due to a lookup error or because it was too small)
+int sbpFormatAddress(struct sockaddr *address,socklen_t addrLen,char*addrStr,uint32_t *addrStrLen){
+    char serviceBuf[80];
+    socklen_t addrStrLen2=(socklen_t)(*addrStrLen);
+    int ierr=0;
+    if (getnameinfo(address, addrLen, addrStr, addrStrLen2, &serviceBuf[0],
+        (socklen_t)sizeof(serviceBuf), 0))
+    {
+        addrStr[0]=0;
+        *addrStrLen=0;
+        // failed to resolve hostanme
+        ierr=1;
+    } else {
+        size_t i,ii;
+        size_t addrL=strlen(addrStr);
+        size_t portL=strlen(&serviceBuf[0]);
+        ii=addrL;
+        if (ii< *addrStrLen){
+            addrStr[ii]=' ';
+            ++ii;
+        }
+        for (i=0;i<portL;++i){
+            if (ii== *addrStrLen){
+                // not enough space
+                ierr=1;
+                break;
+            }
+            addrStr[ii]=serviceBuf[i];
+            ++ii;
+        }
+        if (ii<*addrStrLen)
+            addrStr[ii]=0;
+        *addrStrLen=ii;
+    }
+    return ierr;
+}
+
 /// returns 1 if addrStr could not be fully initialized (either due to a lookup error 
 /// or because it was too small)
 int sbpAccept32(socket_t sock,socket_t *newSock,char*addrStr,uint32_t *addrStrLen){
-    fd_set readSock;
+    struct pollfd pollSock[max_listening_sockets];
     struct sbp_listening_sockets *lS;
+    int iSock;
     *newSock=-1;
-    for (lS=sbpListeningSockets;lS;lS->next){
+    for (lS=sbpListeningSockets;lS;lS=lS->next){
         if (lS->externalId==sock){
             break;
         }
     }
-    if (! lS || lS->externalId!=sock){
+    if (! lS){
         fprintf(stderr,"SBP requested socket is not have listening type\n");
+        return 18;
+    }
+    for (iSock=0;iSock<lS->nSockets;++iSock){
+        pollSock[iSock].fd=lS->socktable[iSock];
+        pollSock[iSock].events=POLLIN;
     }
     while (1){
         int nSock,ndesc,ierr=0;
-        memcpy(&readSock,&(lS->selectSet),sizeof(readSock)); // linux does not define FD_COPY
-        ndesc=select(lS->maxDesc+1, &readSock, NULL, NULL, NULL);
+        for (iSock=0;iSock<lS->nSockets;++iSock){
+            pollSock[iSock].revents=0;
+        }
+        // poll (unlike select) works also with descriptors larger than FD_SETSIZE
+        ndesc=poll(pollSock,lS->nSockets,-1);
         if (ndesc<0){
             if (errno!=EINTR){
-                perror("SBP error while waiting in select");
+                perror("SBP error while waiting in poll");
             }
         }
         if (ndesc>0){
-            int iSock;
             nSock=lS->nSockets;
             int firstSock=lS->lastISock+1;
             for (iSock=0;iSock<nSock;++iSock){
                 int iSockAtt=(iSock+firstSock)%nSock;
                 lS->lastISock=iSockAtt;
-                if (FD_ISSET(lS->socktable[iSockAtt],&readSock)){
-                    char serviceBuf[80];
+                if (pollSock[iSockAtt].revents&POLLIN){
                     struct sockaddr_storage address;
                     socklen_t addrLen=(socklen_t)sizeof(address);
-                    socklen_t addrStrLen2=(socklen_t)(*addrStrLen);
                     *newSock=accept(lS->socktable[iSockAtt],(struct sockaddr*)&address,&addrLen);
                     if (*newSock<=0){
                         perror("SBP accepting socket");
                         return 33;
                     }
-                    if (getnameinfo((struct sockaddr*)&address, addrLen, addrStr, addrStrLen2, &serviceBuf[0],
-                        (socklen_t)sizeof(serviceBuf), 0))
-                    {
-                        addrStr[0]=0;
-                        // failed to resolve hostanme
-                        ierr=1;
-                    } else {
-                        size_t i,ii;
-                        int addrL=strlen(addrStr);
-                        int portL=strlen(&serviceBuf[0]);
-                        ii=addrL;
-                        addrStr[ii]=' ';
-                        ++ii;
-                        for (i=0;i<addrL;++i){
-                            if (ii== *addrStrLen){
-                                // not enough space
-                                ierr=1;
-                                break;
-                            }
-                            addrStr[ii]=serviceBuf[i];
-                            ++ii;
-                        }
-                        if (ii<*addrStrLen)
-                            addrStr[ii]=0;
-                        *addrStrLen=ii;
+                    ierr=sbpFormatAddress((struct sockaddr*)&address,addrLen,addrStr,addrStrLen);
+                    if (sbpHandshakeAccept(*newSock)!=0){
+                        fprintf(stderr,"SBP connection handshake failed\n");
+                        return 34;
                     }
                     return ierr;
                 }
@@ -43,15 +43,39 @@ enum SBP_KIND{
     kind_raw=0,         // binary blob
     kind_char=1,        // characters
     kind_int_small=2,   // small endian 4 bytes integers
-    kind_double_small=3 // small endian doubles
+    kind_double_small=3, // small endian doubles
+    kind_handshake=0x53424d00,    // connection handshake (capabilities, shared memory)
+    kind_mux_fragment=0x53424300, // fragment of a message of a multiplexed channel
+    kind_raw_packed=0x53425000,   // compressed kind_raw (length is the unpacked length)
+    kind_int_packed=0x53425002,   // compressed kind_int_small
+    kind_double_packed=0x53425003 // compressed kind_double_small
+};
+/// capabilities negotiated in the connection handshake
+enum SBP_CAPS{
+    sbp_cap_shm=1,      // shared memory transport
+    sbp_cap_packed=2,   // packed payloads
+    sbp_cap_reply=4     // set in the answer to a handshake
 };
 typedef int socket_t;
+/// a batch of messages that are sent together with a single vectored write
+typedef struct sbp_batch sbp_batch;
+/// a buffered receive context attached to a socket
+typedef struct sbp_reader sbp_reader;
 
 /// initializes the library (checks if endianness swap is needed)
 int sbpInit();
 /// stops the library
 int sbpEnd();
 
+/////////// byte swapping ////////
+// vectorized kernels (chosen at sbpInit according to the cpu) used when the byte
+// order has to be inverted, len is in bytes, and dst may be equal to src
+
+void sbpCopyInvert4(void *dst,const void *src,uint64_t len);
+void sbpCopyInvert8(void *dst,const void *src,uint64_t len);
+void sbpInvert4InPlace(void *p,uint64_t len);
+void sbpInvert8InPlace(void *p,uint64_t len);
+
 /////////// sending ////////
 
 int sbpSendHeader64(socket_t sock, int32_t kind, uint64_t len);
@@ -72,6 +96,26 @@ int sbpSendDoubleArray64(socket_t sock, void *p, uint64_t len);
 int sbpSendDoubleArray32(socket_t sock, void *p, uint32_t len);
 int sbpSendDoublePiece32(socket_t sock, void *p, uint32_t len);
 
+/////////// batched sending ////////
+// messages added to a batch are sent only at the next sbpBatchFlush, with as few
+// system calls as possible. Small payloads (and those that need byte swapping) are
+// copied, larger arrays are only referenced, and must not change until the flush.
+// An add that fails leaves the batch unchanged.
+
+/// creates a batch that will send to the given socket
+int sbpBatchInit(sbp_batch **batch,socket_t sock);
+/// frees the batch (unflushed messages are discarded)
+int sbpBatchFree(sbp_batch *batch);
+int sbpBatchAddHeader64(sbp_batch *batch,int32_t kind,uint64_t len);
+int sbpBatchAddChars32(sbp_batch *batch,char* p,uint32_t len);
+int sbpBatchAddChars64(sbp_batch *batch,char* p,uint64_t len);
+int sbpBatchAddInt4Array32(sbp_batch *batch,void *p,uint32_t len);
+int sbpBatchAddInt4Array64(sbp_batch *batch,void *p,uint64_t len);
+int sbpBatchAddDoubleArray32(sbp_batch *batch,void *p,uint32_t len);
+int sbpBatchAddDoubleArray64(sbp_batch *batch,void *p,uint64_t len);
+/// sends all the messages in the batch and empties it (also in case of errors)
+int sbpBatchFlush(sbp_batch *batch);
+
 //////// receiving ///////
 
 int sbpReadHeader64(socket_t sock, uint32_t *kind, uint64_t *len);
@@ -94,6 +138,158 @@ int sbpReadDoublePiece64(socket_t sock, void *p, uint64_t len);
 int sbpReadDoubleArray32(socket_t sock, void *p, uint32_t len);
 int sbpReadDoublePiece32(socket_t sock, void *p, uint32_t len);
 
+//////// buffered receiving ///////
+// once a reader is attached to a socket all the sbpRead* calls on it are served from
+// a buffer that is filled with as much data as the socket has available, so that
+// many small messages can be received with few system calls. Reads larger than
+// half the buffer go directly to the destination array.
+
+/// attaches a reader with a buffer of bufSize bytes (0 for the default) to sock
+int sbpReaderAttach(socket_t sock,uint64_t bufSize);
+/// removes the reader of sock (returns 1 if buffered data was discarded)
+int sbpReaderDetach(socket_t sock);
+/// number of bytes already received and buffered for sock
+uint64_t sbpReaderBuffered(socket_t sock);
+
+//////// zero copy transfers ////////
+// file payloads go from the page cache to the socket (sendfile) and from the socket
+// to the file (splice) without passing through user space, the file content is sent
+// as is, so it should already be in the protocol byte order.
+// Large arrays can be sent with MSG_ZEROCOPY: the pages are pinned and sent by the
+// kernel, so the array must not change until sbpZeroCopyDone/Wait report the ticket
+// of the send as completed. Where this is not supported (or bytes need swapping)
+// a normal send is done, and the ticket is immediately completed.
+
+/// a zero copy send context for a socket
+typedef struct sbp_zerocopy sbp_zerocopy;
+
+/// sends len bytes of the file fd starting at offset
+int sbpSendFdPiece64(socket_t sock,int fd,uint64_t offset,uint64_t len);
+/// sends a header and len bytes of the file fd starting at offset
+int sbpSendFd64(socket_t sock,int32_t kind,int fd,uint64_t offset,uint64_t len);
+/// writes the next len received bytes to the file fd starting at offset
+int sbpReadToFdPiece64(socket_t sock,int fd,uint64_t offset,uint64_t len);
+/// reads a header and writes the payload to the file fd starting at offset
+int sbpReadToFd64(socket_t sock,uint32_t *kind,int fd,uint64_t offset,uint64_t *len);
+
+/// creates a zero copy context for sock
+int sbpZeroCopyInit(sbp_zerocopy **zc,socket_t sock);
+int sbpZeroCopyFree(sbp_zerocopy *zc);
+/// 1 if sends really avoid the copy
+int sbpZeroCopyEnabled(sbp_zerocopy *zc);
+/// sends the bytes (no header), p must stay unchanged until ticket is done
+int sbpZeroCopyPiece64(sbp_zerocopy *zc,void *p,uint64_t len,uint32_t *ticket);
+int sbpZeroCopyChars64(sbp_zerocopy *zc,char *p,uint64_t len,uint32_t *ticket);
+int sbpZeroCopyInt4Array64(sbp_zerocopy *zc,void *p,uint64_t len,uint32_t *ticket);
+int sbpZeroCopyDoubleArray64(sbp_zerocopy *zc,void *p,uint64_t len,uint32_t *ticket);
+/// 1 if the send with the given ticket is completed (does not block)
+int sbpZeroCopyDone(sbp_zerocopy *zc,uint32_t ticket);
+/// waits for the completion of the send with the given ticket
+int sbpZeroCopyWait(sbp_zerocopy *zc,uint32_t ticket);
+
+//////// shared memory transport ////////
+// when enabled on both sides, connections made with sbpConnectTo/sbpAccept between
+// processes on the same node switch to a pair of ring buffers in a shared memory
+// segment. The framing and all the sbp* calls stay the same, data is copied
+// directly between the arrays and the rings. The sbpServe server keeps TCP.
+
+/// the shared memory transport of a socket
+typedef struct sbp_shm sbp_shm;
+
+/// enables (or disables) the transport for the connections made afterwards,
+/// ringSize is the size of each direction (0 for the default, rounded up to a power of 2)
+int sbpShmEnable(int enable,uint64_t ringSize);
+/// 1 if sock uses the shared memory transport
+int sbpShmActive(socket_t sock);
+
+//////// packed payloads ////////
+// when enabled on both sides, int and double arrays of at least minLen bytes sent with
+// sbpSendInt4Array*/sbpSendDoubleArray* to a connection made with sbpConnectTo/sbpAccept
+// are compressed (kind_int_packed/kind_double_packed), and sbpReadInt4Array*/
+// sbpReadDoubleArray* unpack them. Useful for smooth fields on slow links, on fast
+// links the compression costs more than it saves. Non blocking receives and the
+// *Piece functions do not handle packed payloads.
+
+/// enables (or disables) packing for the connections made afterwards,
+/// minLen is the minimum size in bytes of a packed array (0 for the default, 64 KiB)
+int sbpPackEnable(int enable,uint64_t minLen);
+/// 1 if the arrays sent to sock can be packed
+int sbpPackActive(socket_t sock);
+/// sends p packed with the given packed kind, byteLen is the unpacked length
+/// (this works also if the peer did not negotiate packing, as long as it can unpack)
+int sbpSendPacked64(socket_t sock,int32_t kind,void *p,uint64_t byteLen);
+/// reads the payload of a packed message whose header was already read
+int sbpReadPacked64(socket_t sock,int32_t kind,void *p,uint64_t byteLen);
+int sbpSendInt4ArrayPacked64(socket_t sock,void *p,uint64_t len);
+int sbpSendDoubleArrayPacked64(socket_t sock,void *p,uint64_t len);
+
+//////// multiplexed channels ////////
+// a mux carries several independent streams (channels) of messages on one connection:
+// messages are split in fragments of at most fragSize bytes, and the fragments of the
+// channels with queued messages are sent in round robin, so that small messages are
+// not stuck behind large ones. Both sides have to use a mux, normal messages received
+// by a mux are delivered on channel 0. Sends and receives can be called from several
+// threads at once, messages of other channels read while waiting are kept in per
+// channel queues. A send returns once the message is written.
+
+/// multiplexed channels on a socket
+typedef struct sbp_mux sbp_mux;
+
+/// creates a mux on sock, fragSize is the maximum fragment size (0 for the default, 64 KiB)
+int sbpMuxInit(sbp_mux **mux,socket_t sock,uint64_t fragSize);
+/// frees the mux (and the messages still queued), the socket is not closed
+int sbpMuxFree(sbp_mux *mux);
+/// sends len bytes as a message of the given kind (no byte swapping)
+int sbpMuxSend64(sbp_mux *mux,uint32_t channel,int32_t kind,void *p,uint64_t len);
+int sbpMuxSendChars64(sbp_mux *mux,uint32_t channel,char *p,uint64_t len);
+int sbpMuxSendInt4Array64(sbp_mux *mux,uint32_t channel,void *p,uint64_t len);
+int sbpMuxSendDoubleArray64(sbp_mux *mux,uint32_t channel,void *p,uint64_t len);
+/// receives the next message of the channel, *data is allocated with malloc and must
+/// be freed by the caller (int and double arrays are in the host byte order)
+int sbpMuxRecv64(sbp_mux *mux,uint32_t channel,uint32_t *kind,void **data,uint64_t *len);
+int sbpMuxReadChars64(sbp_mux *mux,uint32_t channel,char *p,uint64_t *len);
+int sbpMuxReadInt4Array64(sbp_mux *mux,uint32_t channel,void *p,uint64_t len);
+int sbpMuxReadDoubleArray64(sbp_mux *mux,uint32_t channel,void *p,uint64_t len);
+/// number of messages of the channel waiting to be sent and received
+int sbpMuxQueued(sbp_mux *mux,uint32_t channel,uint64_t *nSend,uint64_t *nRecv);
+
+//////// non blocking communication ////////
+// sbpIsend*/sbpIrecv* start a transfer and return a request at once, the data moves
+// while sbpProgress, sbpTest, sbpWait or sbpWaitAny are called, or continuously if
+// the progress thread is running. Like in MPI the arrays must not be used until the
+// request completes, the requests of a socket complete in order, and sbpTest/sbpWait/
+// sbpWaitAny free the completed request (setting it to NULL) and return its error.
+// Receives check the kind, int and double receives need exactly len elements,
+// chars receives store the received length in *len (that must stay valid).
+
+/// a pending non blocking transfer
+typedef struct sbp_request sbp_request;
+
+int sbpIsendChars32(socket_t sock,char *p,uint32_t len,sbp_request **req);
+int sbpIsendChars64(socket_t sock,char *p,uint64_t len,sbp_request **req);
+int sbpIsendInt4Array32(socket_t sock,void *p,uint32_t len,sbp_request **req);
+int sbpIsendInt4Array64(socket_t sock,void *p,uint64_t len,sbp_request **req);
+int sbpIsendDoubleArray32(socket_t sock,void *p,uint32_t len,sbp_request **req);
+int sbpIsendDoubleArray64(socket_t sock,void *p,uint64_t len,sbp_request **req);
+int sbpIrecvChars32(socket_t sock,char *p,uint32_t *len,sbp_request **req);
+int sbpIrecvChars64(socket_t sock,char *p,uint64_t *len,sbp_request **req);
+int sbpIrecvInt4Array32(socket_t sock,void *p,uint32_t len,sbp_request **req);
+int sbpIrecvInt4Array64(socket_t sock,void *p,uint64_t len,sbp_request **req);
+int sbpIrecvDoubleArray32(socket_t sock,void *p,uint32_t len,sbp_request **req);
+int sbpIrecvDoubleArray64(socket_t sock,void *p,uint64_t len,sbp_request **req);
+/// sets flag to 1 if *req (which might be NULL) is completed
+int sbpTest(sbp_request **req,int *flag);
+/// waits for the completion of *req
+int sbpWait(sbp_request **req);
+/// waits for the completion of one of the count requests (NULL ones are ignored),
+/// index is set to its position, or -1 if all were NULL
+int sbpWaitAny(int count,sbp_request **reqs,int *index);
+/// advances the pending requests without blocking
+int sbpProgress(void);
+/// starts/stops a thread that continuously advances the pending requests
+int sbpProgressThreadStart(void);
+int sbpProgressThreadStop(void);
+
 //////// connection ////////
 
 /// client connect to the given address (which should have the from "host port")
@@ -104,7 +300,8 @@ int sbpConnectTo64(socket_t *sock, char*address,uint64_t len);
 int sbpListenForService32(socket_t *sock,char *service,uint32_t len);
 /// ditto
 int sbpListenForService64(socket_t *sock,char *service,uint64_t len);
-/// closes the given socket (0 read side, 1 write side, 2 both)
+/// closes the given socket (0 read side, 1 write side, 2 both), closing the read side
+/// detaches its reader
 int sbpClose(socket_t sock,int what);
 /// sever command to accept an incoming connection (blocking, add timeout?)
 int sbpAccept32(socket_t sock,socket_t *newSock,char*addrStr,uint32_t*addrLen);
@@ -115,5 +312,58 @@ int sbpGethostname32(char*,uint32_t*);
 /// ditto
 int sbpGethostname64(char*,uint64_t*);
 
+//////// event driven server ////////
+// sbpServe serves many connections with one event loop thread (epoll on linux, poll
+// elsewhere) and nWorkers callback threads. Incoming messages are read incrementally
+// from non blocking sockets and passed whole to the handler of their kind, with
+// int/double payloads already in the local byte order. Messages of one connection are
+// handled in order by one thread at a time, handlers may reply with the sbpSend*
+// functions on msg->sock.
+
+enum SBP_SERVER{
+    sbp_server_max_kinds=16 // kinds that can have a specific handler
+};
+
+/// a message received by the server, data is valid only during the handler call
+typedef struct sbp_message{
+    socket_t sock;
+    uint32_t kind;
+    uint64_t len;       // payload length in bytes
+    void *data;
+    void **connData;    // per connection user data (set in onConnect or in the handlers)
+} sbp_message;
+
+/// message handler, returning non 0 closes the connection
+typedef int (*sbp_msg_handler)(sbp_message *msg,void *ctx);
+/// called for new connections, returning non 0 rejects them
+typedef int (*sbp_connect_handler)(socket_t sock,const char *addr,void **connData,void *ctx);
+/// called when a connection is closed (to release connData)
+typedef void (*sbp_close_handler)(socket_t sock,void **connData,void *ctx);
+
+typedef struct sbp_server_config{
+    int nWorkers;               // callback threads, 0 calls the handlers in the event loop
+    uint64_t maxMessageSize;    // connections sending larger messages are closed (0: no limit)
+    sbp_msg_handler handlers[sbp_server_max_kinds];
+    sbp_msg_handler defaultHandler; // used for kinds without handler
+    sbp_connect_handler onConnect;
+    sbp_close_handler onClose;
+    void *ctx;                  // passed to all the callbacks
+} sbp_server_config;
+
+typedef struct sbp_server sbp_server;
+
+/// creates a server for the given listening socket (from sbpListenForService*)
+int sbpServerCreate(sbp_server **server,socket_t listenSock,sbp_server_config *config);
+/// runs the server until sbpServerStop is called, then closes all its connections
+int sbpServerRun(sbp_server *server);
+/// asks a running server to stop (can be called from handlers and other threads)
+int sbpServerStop(sbp_server *server);
+/// frees the server
+int sbpServerFree(sbp_server *server);
+/// creates, runs and frees a server
+int sbpServe(socket_t listenSock,sbp_server_config *config);
+/// sets the socket in non blocking mode
+int sbpSetNonBlocking(socket_t sock);
+
 #endif
 
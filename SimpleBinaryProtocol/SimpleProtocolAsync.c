@@ -0,0 +1,761 @@
+/// non blocking communication for the simple binary protocol
+/// sbpIsend*/sbpIrecv* queue a message and return a request at once, the data is
+/// moved with non blocking system calls by the progress engine, which runs in
+/// sbpProgress, in sbpTest/sbpWait/sbpWaitAny, or continuously in a progress thread
+/// (sbpProgressThreadStart).
+/// The semantic is modelled on MPI: the arrays must not be touched until the request
+/// is completed, requests of the same socket and direction complete in order, and a
+/// completed request is freed (and set to NULL) by sbpTest/sbpWait/sbpWaitAny, that
+/// return its error code. Blocking sbp* calls on a socket with pending requests in the
+/// same direction would interleave the data, and should be avoided.
+/// author: fawzi
+//
+// Copyright 2008-2010 the blip developer group
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// this file is explicitly released also with GPLv2 for the projects that might need it
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "SimpleProtocol.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+enum SBP_ASYNC_SIZES{
+    async_skip_buf=4096,        // scratch space to discard unwanted payloads
+    async_max_poll=256,         // sockets waited upon at once
+    async_shm_poll_ms=1         // polling period when shared memory requests are pending
+};
+
+// from SimpleProtocol.c
+extern int swapBits;
+void sbpEncodeHeader(char *bufPos, int32_t kind, uint64_t len);
+void sbpDecodeHeader(char *bufPos, uint32_t *kind, uint64_t *len);
+uint64_t sbpReaderConsume(socket_t sock,char **data,uint64_t maxLen);
+uint64_t sbpReaderBuffered(socket_t sock);
+// from SimpleProtocolShm.c
+sbp_shm *sbpShmFor(socket_t sock);
+int64_t sbpShmTryWrite(sbp_shm *shm,const char *src,uint64_t len);
+int64_t sbpShmTryRead(sbp_shm *shm,char *dst,uint64_t len);
+
+struct sbp_request{
+    socket_t sock;
+    int isRecv;
+    int done;
+    int err;
+    int32_t kind;           // kind sent, or expected
+    int elSize;             // size of the elements whose bytes might need swapping
+    char *data;             // user array
+    char *swapped;          // byte swapped copy of the payload (sends on big endian)
+    uint64_t len;           // payload bytes to send, or space available to receive
+    uint64_t *lenOut;       // received length (char receives)
+    uint32_t *lenOut32;
+    int exactLen;           // the received payload must be exactly len bytes
+    uint64_t pos;           // header+payload bytes transferred
+    uint64_t msgLen;        // payload length (of the received header)
+    uint64_t toData;        // bytes of the received payload stored in data
+    char header[12];
+    struct sbp_request *next; // next request of the same socket and direction
+};
+
+/// the pending requests of a socket
+struct sbp_async_sock{
+    socket_t sock;
+    sbp_request *sendHead,*sendTail;
+    sbp_request *recvHead,*recvTail;
+    struct sbp_async_sock *next;
+};
+
+static pthread_mutex_t sbpAsyncLock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sbpAsyncCompleted=PTHREAD_COND_INITIALIZER;
+static struct sbp_async_sock *sbpAsyncSocks=NULL;
+static int sbpProgressRunning=0,sbpProgressStopping=0;
+static pthread_t sbpProgressThreadId;
+static int sbpProgressWake[2]={-1,-1};
+
+/// pending requests of sock (created if create is true), call with the lock held
+static struct sbp_async_sock *sbpAsyncSockFor(socket_t sock,int create){
+    struct sbp_async_sock *s;
+    for (s=sbpAsyncSocks;s;s=s->next){
+        if (s->sock==sock) return s;
+    }
+    if (!create) return NULL;
+    s=(struct sbp_async_sock*)calloc(1,sizeof(struct sbp_async_sock));
+    if (!s) return NULL;
+    s->sock=sock;
+    s->next=sbpAsyncSocks;
+    sbpAsyncSocks=s;
+    return s;
+}
+
+static void sbpAsyncComplete(sbp_request *req,int err){
+    req->err=err;
+    req->done=1;
+    pthread_cond_broadcast(&sbpAsyncCompleted);
+}
+
+/// moves as much as possible of the head send request without blocking
+/// returns 1 if it completed
+static int sbpAsyncSendSome(sbp_request *req){
+    sbp_shm *shm=sbpShmFor(req->sock);
+    char *payload=req->swapped?req->swapped:req->data;
+    while (req->pos<12+req->len){
+        struct iovec iov[2];
+        int nIov=0;
+        ssize_t sent;
+        if (req->pos<12){
+            iov[0].iov_base=req->header+req->pos;
+            iov[0].iov_len=(size_t)(12-req->pos);
+            nIov=1;
+        }
+        if (req->len>0){
+            uint64_t payloadPos=(req->pos<12)?0:req->pos-12;
+            iov[nIov].iov_base=payload+payloadPos;
+            iov[nIov].iov_len=(size_t)(req->len-payloadPos);
+            ++nIov;
+        }
+        if (shm){
+            int64_t w=sbpShmTryWrite(shm,(const char*)iov[0].iov_base,iov[0].iov_len);
+            if (w<0){
+                sbpAsyncComplete(req,1);
+                return 1;
+            }
+            if (w==0) return 0;
+            req->pos+=(uint64_t)w;
+            continue;
+        } else {
+            struct msghdr msg;
+            memset(&msg,0,sizeof(msg));
+            msg.msg_iov=iov;
+            msg.msg_iovlen=nIov;
+            sent=sendmsg(req->sock,&msg,MSG_DONTWAIT|MSG_NOSIGNAL);
+        }
+        if (sent<0){
+            if (errno==EINTR) continue;
+            if (errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+            perror("SBP error in non blocking send");
+            sbpAsyncComplete(req,1);
+            return 1;
+        }
+        req->pos+=(uint64_t)sent;
+    }
+    sbpAsyncComplete(req,0);
+    return 1;
+}
+
+/// reads up to len bytes to dst (NULL discards) without blocking
+/// returns the bytes read, or -1 at EOF or on errors
+static int64_t sbpAsyncRecvBytes(socket_t sock,sbp_shm *shm,char *dst,uint64_t len){
+    char skipBuf[async_skip_buf];
+    char *buffered;
+    uint64_t n;
+    ssize_t readB;
+    if (shm) return sbpShmTryRead(shm,dst,len);
+    // data already read by a reader comes first
+    if ((n=sbpReaderConsume(sock,&buffered,len))>0){
+        if (dst) memcpy(dst,buffered,(size_t)n);
+        return (int64_t)n;
+    }
+    if (!dst && len>async_skip_buf) len=async_skip_buf;
+    while (1){
+        readB=recv(sock,dst?dst:skipBuf,(size_t)len,MSG_DONTWAIT);
+        if (readB>0) return (int64_t)readB;
+        if (readB==0) return -1;
+        if (errno==EINTR) continue;
+        if (errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+        perror("SBP error in non blocking receive");
+        return -1;
+    }
+}
+
+/// the header was received: decides what goes in the user array and what is skipped
+static void sbpAsyncGotHeader(sbp_request *req){
+    uint32_t kind;
+    sbpDecodeHeader(req->header,&kind,&req->msgLen);
+    req->toData=0;
+    if ((int32_t)kind!=req->kind){
+        req->err=14;
+    } else if (req->exactLen && req->msgLen!=req->len){
+        req->err=15;
+    } else if (req->msgLen>req->len){
+        req->toData=req->len;
+        req->err=1; // truncated
+    } else {
+        req->toData=req->msgLen;
+    }
+}
+
+/// the message was received, swaps the bytes and sets the output length
+static void sbpAsyncRecvDone(sbp_request *req){
+    if (req->err==0 && swapBits){
+        if (req->elSize==4){
+            sbpInvert4InPlace(req->data,req->toData);
+        } else if (req->elSize==8){
+            sbpInvert8InPlace(req->data,req->toData);
+        }
+    }
+    if (req->kind==kind_char && req->err!=14){
+        if (req->toData<req->len) req->data[req->toData]=0;
+        if (req->lenOut) *req->lenOut=req->toData;
+        if (req->lenOut32) *req->lenOut32=(uint32_t)req->toData;
+    }
+    sbpAsyncComplete(req,req->err);
+}
+
+/// moves as much as possible of the head receive request without blocking
+/// returns 1 if it completed
+static int sbpAsyncRecvSome(sbp_request *req){
+    sbp_shm *shm=sbpShmFor(req->sock);
+    while (1){
+        int64_t readB;
+        if (req->pos<12){
+            readB=sbpAsyncRecvBytes(req->sock,shm,req->header+req->pos,12-req->pos);
+        } else if (req->pos-12<req->toData){
+            uint64_t dataPos=req->pos-12;
+            readB=sbpAsyncRecvBytes(req->sock,shm,req->data+dataPos,req->toData-dataPos);
+        } else if (req->pos-12<req->msgLen){
+            readB=sbpAsyncRecvBytes(req->sock,shm,NULL,req->msgLen-(req->pos-12));
+        } else {
+            sbpAsyncRecvDone(req);
+            return 1;
+        }
+        if (readB<0){
+            fprintf(stderr,"SBP connection %d closed with a pending receive\n",req->sock);
+            sbpAsyncComplete(req,5);
+            return 1;
+        }
+        if (readB==0) return 0;
+        req->pos+=(uint64_t)readB;
+        if (req->pos==12) sbpAsyncGotHeader(req);
+    }
+}
+
+/// advances all the pending requests without blocking, call with the lock held
+/// returns the number of requests completed
+static int sbpAsyncProgressLocked(void){
+    struct sbp_async_sock *s,*prev=NULL,*nextS;
+    int completed=0;
+    for (s=sbpAsyncSocks;s;s=nextS){
+        nextS=s->next;
+        while (s->sendHead && sbpAsyncSendSome(s->sendHead)){
+            s->sendHead=s->sendHead->next;
+            ++completed;
+        }
+        if (!s->sendHead) s->sendTail=NULL;
+        while (s->recvHead && sbpAsyncRecvSome(s->recvHead)){
+            s->recvHead=s->recvHead->next;
+            ++completed;
+        }
+        if (!s->recvHead) s->recvTail=NULL;
+        if (!s->sendHead && !s->recvHead){
+            if (prev){
+                prev->next=nextS;
+            } else {
+                sbpAsyncSocks=nextS;
+            }
+            free(s);
+        } else {
+            prev=s;
+        }
+    }
+    return completed;
+}
+
+/// waits (at most timeoutMs, -1 for no limit) until a socket with pending requests
+/// is ready, call without the lock
+static void sbpAsyncPoll(int timeoutMs){
+    struct pollfd pfds[async_max_poll+1];
+    struct sbp_async_sock *s;
+    int nFds=0;
+    pthread_mutex_lock(&sbpAsyncLock);
+    for (s=sbpAsyncSocks;s && nFds<async_max_poll;s=s->next){
+        if (sbpShmFor(s->sock)){
+            // rings cannot be waited upon with poll
+            if (timeoutMs<0 || timeoutMs>async_shm_poll_ms) timeoutMs=async_shm_poll_ms;
+            continue;
+        }
+        if (s->recvHead && sbpReaderBuffered(s->sock)>0) timeoutMs=0;
+        pfds[nFds].fd=s->sock;
+        pfds[nFds].events=(short)((s->sendHead?POLLOUT:0)|(s->recvHead?POLLIN:0));
+        pfds[nFds].revents=0;
+        ++nFds;
+    }
+    if (s){
+        // too many sockets to wait on all of them, come back soon
+        timeoutMs=(timeoutMs<0 || timeoutMs>async_shm_poll_ms)?async_shm_poll_ms:timeoutMs;
+    }
+    if (sbpProgressRunning){
+        pfds[nFds].fd=sbpProgressWake[0];
+        pfds[nFds].events=POLLIN;
+        pfds[nFds].revents=0;
+        ++nFds;
+    }
+    pthread_mutex_unlock(&sbpAsyncLock);
+    if (nFds==0 && timeoutMs<0) return;
+    if (poll(pfds,(nfds_t)nFds,timeoutMs)<0 && errno!=EINTR){
+        perror("SBP error waiting in the progress engine");
+    }
+}
+
+static void sbpAsyncWakeProgress(void){
+    if (sbpProgressRunning){
+        char c=0;
+        while (write(sbpProgressWake[1],&c,1)<0 && errno==EINTR){}
+    }
+}
+
+/// queues a request and tries to advance it at once
+static int sbpAsyncEnqueue(sbp_request *req,sbp_request **reqOut){
+    struct sbp_async_sock *s;
+    pthread_mutex_lock(&sbpAsyncLock);
+    s=sbpAsyncSockFor(req->sock,1);
+    if (!s){
+        pthread_mutex_unlock(&sbpAsyncLock);
+        free(req->swapped);
+        free(req);
+        *reqOut=NULL;
+        return 2;
+    }
+    if (req->isRecv){
+        if (s->recvTail){
+            s->recvTail->next=req;
+        } else {
+            s->recvHead=req;
+        }
+        s->recvTail=req;
+    } else {
+        if (s->sendTail){
+            s->sendTail->next=req;
+        } else {
+            s->sendHead=req;
+        }
+        s->sendTail=req;
+    }
+    *reqOut=req;
+    sbpAsyncProgressLocked();
+    sbpAsyncWakeProgress();
+    pthread_mutex_unlock(&sbpAsyncLock);
+    return 0;
+}
+
+static int sbpIsend(socket_t sock,int32_t kind,void *p,uint64_t byteLen,int elSize,sbp_request **reqOut){
+    sbp_request *req=(sbp_request*)calloc(1,sizeof(sbp_request));
+    *reqOut=NULL;
+    if (!req) return 2;
+    req->sock=sock;
+    req->kind=kind;
+    req->elSize=elSize;
+    req->data=(char*)p;
+    req->len=byteLen;
+    sbpEncodeHeader(req->header,kind,byteLen);
+    if (swapBits && elSize>1 && byteLen>0){
+        req->swapped=(char*)malloc((size_t)byteLen);
+        if (!req->swapped){
+            free(req);
+            return 2;
+        }
+        if (elSize==4){
+            sbpCopyInvert4(req->swapped,p,byteLen);
+        } else {
+            sbpCopyInvert8(req->swapped,p,byteLen);
+        }
+    }
+    return sbpAsyncEnqueue(req,reqOut);
+}
+
+static int sbpIrecv(socket_t sock,int32_t kind,void *p,uint64_t byteLen,int elSize,int exactLen,
+    uint64_t *lenOut,uint32_t *lenOut32,sbp_request **reqOut)
+{
+    sbp_request *req=(sbp_request*)calloc(1,sizeof(sbp_request));
+    *reqOut=NULL;
+    if (!req) return 2;
+    req->sock=sock;
+    req->isRecv=1;
+    req->kind=kind;
+    req->elSize=elSize;
+    req->data=(char*)p;
+    req->len=byteLen;
+    req->exactLen=exactLen;
+    req->lenOut=lenOut;
+    req->lenOut32=lenOut32;
+    return sbpAsyncEnqueue(req,reqOut);
+}
+
+//////// sending ////////
+
+int sbpIsendChars64(socket_t sock,char *p,uint64_t len,sbp_request **req){
+    return sbpIsend(sock,kind_char,p,len,1,req);
+}
+/// f77 interface
+void sbpisendc64n(int *ierr,socket_t*sock,char*p,sbp_request **req,uint64_t len){
+    *ierr=sbpIsendChars64(*sock,p,len,req);
+}
+void sbpisendc64n_(int *ierr,socket_t*sock,char*p,sbp_request **req,uint64_t len){
+    *ierr=sbpIsendChars64(*sock,p,len,req);
+}
+void sbpisendc64n__(int *ierr,socket_t*sock,char*p,sbp_request **req,uint64_t len){
+    *ierr=sbpIsendChars64(*sock,p,len,req);
+}
+
+int sbpIsendChars32(socket_t sock,char *p,uint32_t len,sbp_request **req){
+    return sbpIsend(sock,kind_char,p,(uint64_t)len,1,req);
+}
+/// f77 interface
+void sbpisendc32n(int *ierr,socket_t*sock,char*p,sbp_request **req,uint32_t len){
+    *ierr=sbpIsendChars32(*sock,p,len,req);
+}
+void sbpisendc32n_(int *ierr,socket_t*sock,char*p,sbp_request **req,uint32_t len){
+    *ierr=sbpIsendChars32(*sock,p,len,req);
+}
+void sbpisendc32n__(int *ierr,socket_t*sock,char*p,sbp_request **req,uint32_t len){
+    *ierr=sbpIsendChars32(*sock,p,len,req);
+}
+
+int sbpIsendInt4Array64(socket_t sock,void *p,uint64_t len,sbp_request **req){
+    return sbpIsend(sock,kind_int_small,p,4UL*len,4,req);
+}
+/// f77 interface
+void sbpisendi64(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIsendInt4Array64(*sock,p,*len,req);
+}
+void sbpisendi64_(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIsendInt4Array64(*sock,p,*len,req);
+}
+void sbpisendi64__(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIsendInt4Array64(*sock,p,*len,req);
+}
+
+int sbpIsendInt4Array32(socket_t sock,void *p,uint32_t len,sbp_request **req){
+    return sbpIsend(sock,kind_int_small,p,4UL*(uint64_t)len,4,req);
+}
+/// f77 interface
+void sbpisendi32(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIsendInt4Array32(*sock,p,*len,req);
+}
+void sbpisendi32_(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIsendInt4Array32(*sock,p,*len,req);
+}
+void sbpisendi32__(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIsendInt4Array32(*sock,p,*len,req);
+}
+
+int sbpIsendDoubleArray64(socket_t sock,void *p,uint64_t len,sbp_request **req){
+    return sbpIsend(sock,kind_double_small,p,8UL*len,8,req);
+}
+/// f77 interface
+void sbpisendd64(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIsendDoubleArray64(*sock,p,*len,req);
+}
+void sbpisendd64_(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIsendDoubleArray64(*sock,p,*len,req);
+}
+void sbpisendd64__(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIsendDoubleArray64(*sock,p,*len,req);
+}
+
+int sbpIsendDoubleArray32(socket_t sock,void *p,uint32_t len,sbp_request **req){
+    return sbpIsend(sock,kind_double_small,p,8UL*(uint64_t)len,8,req);
+}
+/// f77 interface
+void sbpisendd32(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIsendDoubleArray32(*sock,p,*len,req);
+}
+void sbpisendd32_(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIsendDoubleArray32(*sock,p,*len,req);
+}
+void sbpisendd32__(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIsendDoubleArray32(*sock,p,*len,req);
+}
+
+//////// receiving ////////
+
+int sbpIrecvChars64(socket_t sock,char *p,uint64_t *len,sbp_request **req){
+    return sbpIrecv(sock,kind_char,p,*len,1,0,len,NULL,req);
+}
+/// f77 interface, rLen (that must stay valid until the completion) is set to the
+/// received length
+void sbpirecvc64n(int *ierr,socket_t*sock,char*p,uint64_t*rLen,sbp_request **req,uint64_t len){
+    *rLen=len;
+    *ierr=sbpIrecvChars64(*sock,p,rLen,req);
+}
+void sbpirecvc64n_(int *ierr,socket_t*sock,char*p,uint64_t*rLen,sbp_request **req,uint64_t len){
+    sbpirecvc64n(ierr,sock,p,rLen,req,len);
+}
+void sbpirecvc64n__(int *ierr,socket_t*sock,char*p,uint64_t*rLen,sbp_request **req,uint64_t len){
+    sbpirecvc64n(ierr,sock,p,rLen,req,len);
+}
+
+int sbpIrecvChars32(socket_t sock,char *p,uint32_t *len,sbp_request **req){
+    return sbpIrecv(sock,kind_char,p,(uint64_t)*len,1,0,NULL,len,req);
+}
+
+int sbpIrecvInt4Array64(socket_t sock,void *p,uint64_t len,sbp_request **req){
+    return sbpIrecv(sock,kind_int_small,p,4UL*len,4,1,NULL,NULL,req);
+}
+/// f77 interface
+void sbpirecvi64(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIrecvInt4Array64(*sock,p,*len,req);
+}
+void sbpirecvi64_(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIrecvInt4Array64(*sock,p,*len,req);
+}
+void sbpirecvi64__(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIrecvInt4Array64(*sock,p,*len,req);
+}
+
+int sbpIrecvInt4Array32(socket_t sock,void *p,uint32_t len,sbp_request **req){
+    return sbpIrecv(sock,kind_int_small,p,4UL*(uint64_t)len,4,1,NULL,NULL,req);
+}
+/// f77 interface
+void sbpirecvi32(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIrecvInt4Array32(*sock,p,*len,req);
+}
+void sbpirecvi32_(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIrecvInt4Array32(*sock,p,*len,req);
+}
+void sbpirecvi32__(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIrecvInt4Array32(*sock,p,*len,req);
+}
+
+int sbpIrecvDoubleArray64(socket_t sock,void *p,uint64_t len,sbp_request **req){
+    return sbpIrecv(sock,kind_double_small,p,8UL*len,8,1,NULL,NULL,req);
+}
+/// f77 interface
+void sbpirecvd64(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIrecvDoubleArray64(*sock,p,*len,req);
+}
+void sbpirecvd64_(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIrecvDoubleArray64(*sock,p,*len,req);
+}
+void sbpirecvd64__(int*ierr,socket_t*sock,void*p,uint64_t*len,sbp_request **req){
+    *ierr=sbpIrecvDoubleArray64(*sock,p,*len,req);
+}
+
+int sbpIrecvDoubleArray32(socket_t sock,void *p,uint32_t len,sbp_request **req){
+    return sbpIrecv(sock,kind_double_small,p,8UL*(uint64_t)len,8,1,NULL,NULL,req);
+}
+/// f77 interface
+void sbpirecvd32(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIrecvDoubleArray32(*sock,p,*len,req);
+}
+void sbpirecvd32_(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIrecvDoubleArray32(*sock,p,*len,req);
+}
+void sbpirecvd32__(int*ierr,socket_t*sock,void*p,uint32_t*len,sbp_request **req){
+    *ierr=sbpIrecvDoubleArray32(*sock,p,*len,req);
+}
+
+//////// completion ////////
+
+int sbpProgress(void){
+    pthread_mutex_lock(&sbpAsyncLock);
+    sbpAsyncProgressLocked();
+    pthread_mutex_unlock(&sbpAsyncLock);
+    return 0;
+}
+/// f77 interface
+void sbpprogress(int *ierr){
+    *ierr=sbpProgress();
+}
+void sbpprogress_(int *ierr){
+    *ierr=sbpProgress();
+}
+void sbpprogress__(int *ierr){
+    *ierr=sbpProgress();
+}
+
+/// frees a completed request, returning its error, call with the lock held
+static int sbpAsyncRelease(sbp_request **req){
+    int err=(*req)->err;
+    free((*req)->swapped);
+    free(*req);
+    *req=NULL;
+    return err;
+}
+
+int sbpTest(sbp_request **req,int *flag){
+    int err=0;
+    *flag=1;
+    if (!*req) return 0;
+    pthread_mutex_lock(&sbpAsyncLock);
+    if (!(*req)->done) sbpAsyncProgressLocked();
+    if ((*req)->done){
+        err=sbpAsyncRelease(req);
+    } else {
+        *flag=0;
+    }
+    pthread_mutex_unlock(&sbpAsyncLock);
+    return err;
+}
+/// f77 interface
+void sbptest(int *ierr,sbp_request **req,int *flag){
+    *ierr=sbpTest(req,flag);
+}
+void sbptest_(int *ierr,sbp_request **req,int *flag){
+    *ierr=sbpTest(req,flag);
+}
+void sbptest__(int *ierr,sbp_request **req,int *flag){
+    *ierr=sbpTest(req,flag);
+}
+
+int sbpWaitAny(int count,sbp_request **reqs,int *index){
+    int i,err,anyPending;
+    *index=-1;
+    pthread_mutex_lock(&sbpAsyncLock);
+    while (1){
+        anyPending=0;
+        for (i=0;i<count;++i){
+            if (!reqs[i]) continue;
+            anyPending=1;
+            if (reqs[i]->done){
+                *index=i;
+                err=sbpAsyncRelease(&reqs[i]);
+                pthread_mutex_unlock(&sbpAsyncLock);
+                return err;
+            }
+        }
+        if (!anyPending) break;
+        if (sbpProgressRunning){
+            pthread_cond_wait(&sbpAsyncCompleted,&sbpAsyncLock);
+        } else if (sbpAsyncProgressLocked()==0){
+            pthread_mutex_unlock(&sbpAsyncLock);
+            sbpAsyncPoll(-1);
+            pthread_mutex_lock(&sbpAsyncLock);
+        }
+    }
+    pthread_mutex_unlock(&sbpAsyncLock);
+    return 0;
+}
+/// f77 interface, index is 1 based (0 if all the requests were null)
+void sbpwaitany(int *ierr,int *count,sbp_request **reqs,int *index){
+    *ierr=sbpWaitAny(*count,reqs,index);
+    *index+=1;
+}
+void sbpwaitany_(int *ierr,int *count,sbp_request **reqs,int *index){
+    sbpwaitany(ierr,count,reqs,index);
+}
+void sbpwaitany__(int *ierr,int *count,sbp_request **reqs,int *index){
+    sbpwaitany(ierr,count,reqs,index);
+}
+
+int sbpWait(sbp_request **req){
+    int index;
+    return sbpWaitAny(1,req,&index);
+}
+/// f77 interface
+void sbpwait(int *ierr,sbp_request **req){
+    *ierr=sbpWait(req);
+}
+void sbpwait_(int *ierr,sbp_request **req){
+    *ierr=sbpWait(req);
+}
+void sbpwait__(int *ierr,sbp_request **req){
+    *ierr=sbpWait(req);
+}
+
+//////// progress thread ////////
+
+static void *sbpProgressLoop(void *arg){
+    (void)arg;
+    while (1){
+        char drain[64];
+        pthread_mutex_lock(&sbpAsyncLock);
+        if (sbpProgressStopping){
+            pthread_mutex_unlock(&sbpAsyncLock);
+            break;
+        }
+        sbpAsyncProgressLocked();
+        pthread_mutex_unlock(&sbpAsyncLock);
+        sbpAsyncPoll(-1);
+        while (read(sbpProgressWake[0],drain,sizeof(drain))>0){}
+    }
+    return NULL;
+}
+
+int sbpProgressThreadStart(void){
+    pthread_mutex_lock(&sbpAsyncLock);
+    if (sbpProgressRunning){
+        pthread_mutex_unlock(&sbpAsyncLock);
+        return 0;
+    }
+    if (pipe(sbpProgressWake)!=0){
+        pthread_mutex_unlock(&sbpAsyncLock);
+        perror("SBP creating the progress wake pipe");
+        return 1;
+    }
+    fcntl(sbpProgressWake[0],F_SETFL,fcntl(sbpProgressWake[0],F_GETFL)|O_NONBLOCK);
+    fcntl(sbpProgressWake[1],F_SETFL,fcntl(sbpProgressWake[1],F_GETFL)|O_NONBLOCK);
+    sbpProgressStopping=0;
+    sbpProgressRunning=1;
+    if (pthread_create(&sbpProgressThreadId,NULL,sbpProgressLoop,NULL)!=0){
+        sbpProgressRunning=0;
+        close(sbpProgressWake[0]);
+        close(sbpProgressWake[1]);
+        pthread_mutex_unlock(&sbpAsyncLock);
+        return 2;
+    }
+    pthread_mutex_unlock(&sbpAsyncLock);
+    return 0;
+}
+/// f77 interface
+void sbpprogstart(int *ierr){
+    *ierr=sbpProgressThreadStart();
+}
+void sbpprogstart_(int *ierr){
+    *ierr=sbpProgressThreadStart();
+}
+void sbpprogstart__(int *ierr){
+    *ierr=sbpProgressThreadStart();
+}
+
+int sbpProgressThreadStop(void){
+    pthread_mutex_lock(&sbpAsyncLock);
+    if (!sbpProgressRunning){
+        pthread_mutex_unlock(&sbpAsyncLock);
+        return 0;
+    }
+    sbpProgressStopping=1;
+    sbpAsyncWakeProgress();
+    pthread_mutex_unlock(&sbpAsyncLock);
+    pthread_join(sbpProgressThreadId,NULL);
+    pthread_mutex_lock(&sbpAsyncLock);
+    sbpProgressRunning=0;
+    close(sbpProgressWake[0]);
+    close(sbpProgressWake[1]);
+    // waiters now have to progress by themselves
+    pthread_cond_broadcast(&sbpAsyncCompleted);
+    pthread_mutex_unlock(&sbpAsyncLock);
+    return 0;
+}
+/// f77 interface
+void sbpprogstop(int *ierr){
+    *ierr=sbpProgressThreadStop();
+}
+void sbpprogstop_(int *ierr){
+    *ierr=sbpProgressThreadStop();
+}
+void sbpprogstop__(int *ierr){
+    *ierr=sbpProgressThreadStop();
+}
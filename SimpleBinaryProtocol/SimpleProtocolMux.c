@@ -0,0 +1,593 @@
+/// multiplexed channels over a single connection of the simple binary protocol
+/// a mux (sbpMuxInit) tags each message with a channel id and splits it into fragments
+/// of at most fragSize bytes, which are sent in round robin among the channels that
+/// have messages queued, so that a small control message is not blocked behind a large
+/// array of another channel. Incoming fragments are reassembled in per channel receive
+/// queues, a receive on a channel returns the first complete message of that channel.
+///
+/// A fragment is a kind_mux_fragment message whose payload starts with 24 bytes (small
+/// endian): channel (4 bytes), kind of the message (4 bytes), total length of the message
+/// (8 bytes) and offset of the fragment (8 bytes); the fragments of a message are sent
+/// in order, the data is in the usual wire format of its kind. Normal messages received
+/// on a mux are delivered on channel 0, so a peer that does not use the extension can
+/// still talk on channel 0 (but it will receive fragments).
+///
+/// Sends and receives can be called concurrently from several threads: the thread that
+/// finds the connection idle writes (or reads) for everybody until its own message is
+/// done, the others wait. A send returns when the message is written, the receive
+/// queues keep copies of the messages. The mux has to be freed before closing the socket.
+/// author: fawzi
+//
+// Copyright 2008-2010 the blip developer group
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// this file is explicitly released also with GPLv2 for the projects that might need it
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "SimpleProtocol.h"
+
+enum SBP_MUX_SIZES{
+    mux_default_frag=65536,     // default fragment size
+    mux_min_frag=64,
+    mux_frag_header=24          // channel, kind, total length, offset
+};
+
+// from SimpleProtocol.c
+extern int swapBits;
+void sbpEncodeHeader(char *bufPos, int32_t kind, uint64_t len);
+int sbpWriteAllV(socket_t sock,struct iovec *iov,size_t iovcnt);
+int sbpReadDirect(socket_t sock,void* start,uint64_t len);
+
+/// a message being sent (lives on the stack of the sender)
+struct sbp_mux_out{
+    struct sbp_mux_out *next;
+    int32_t kind;
+    int elSize;             // size of the elements whose bytes might need swapping
+    const char *data;
+    uint64_t len,sent;
+    int done,err;
+};
+
+/// a received (possibly still incomplete) message
+struct sbp_mux_in{
+    struct sbp_mux_in *next;
+    uint32_t kind;
+    uint64_t len,filled;
+    char *data;
+};
+
+struct sbp_mux_chan{
+    struct sbp_mux_chan *next;
+    uint32_t id;
+    struct sbp_mux_out *sendHead,*sendTail;
+    struct sbp_mux_in *recvHead,*recvTail;
+    struct sbp_mux_in *partial;     // message being reassembled
+    uint64_t nSend,nRecv;           // queued messages
+};
+
+struct sbp_mux{
+    socket_t sock;
+    uint64_t fragSize;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sbp_mux_chan *chans;
+    struct sbp_mux_chan *lastSent;  // round robin position
+    int writing,reading;
+    int err;                        // sticky connection error
+    char *swapBuf;                  // fragment in wire order, used by the writer
+};
+
+static void sbpMuxPut32(char *p,uint32_t v){
+    int i;
+    for (i=0;i<4;++i) p[i]=(char)(v>>(8*i));
+}
+
+static void sbpMuxPut64(char *p,uint64_t v){
+    int i;
+    for (i=0;i<8;++i) p[i]=(char)(v>>(8*i));
+}
+
+static uint64_t sbpMuxGet(const char *p,int n){
+    uint64_t v=0;
+    int i;
+    for (i=0;i<n;++i) v|=((uint64_t)(unsigned char)p[i])<<(8*i);
+    return v;
+}
+
+static int sbpMuxElSize(uint32_t kind){
+    switch (kind){
+    case kind_int_small: return 4;
+    case kind_double_small: return 8;
+    default: return 1;
+    }
+}
+
+/// the channel with the given id, created if needed (lock held)
+static struct sbp_mux_chan *sbpMuxChan(sbp_mux *mux,uint32_t id){
+    struct sbp_mux_chan *c;
+    for (c=mux->chans;c;c=c->next){
+        if (c->id==id) return c;
+    }
+    c=(struct sbp_mux_chan*)calloc(1,sizeof(struct sbp_mux_chan));
+    if (!c) return NULL;
+    c->id=id;
+    c->next=mux->chans;
+    mux->chans=c;
+    return c;
+}
+
+int sbpMuxInit(sbp_mux **mux,socket_t sock,uint64_t fragSize){
+    sbp_mux *m;
+    *mux=NULL;
+    if (fragSize==0) fragSize=mux_default_frag;
+    if (fragSize<mux_min_frag) fragSize=mux_min_frag;
+    fragSize&=~(uint64_t)7; // whole elements
+    m=(sbp_mux*)calloc(1,sizeof(sbp_mux));
+    if (!m) return 1;
+    m->sock=sock;
+    m->fragSize=fragSize;
+    m->swapBuf=(char*)malloc((size_t)fragSize);
+    if (!m->swapBuf){
+        free(m);
+        return 1;
+    }
+    pthread_mutex_init(&m->lock,NULL);
+    pthread_cond_init(&m->cond,NULL);
+    *mux=m;
+    return 0;
+}
+/// f77 interface
+void sbpmuxinit(int *ierr,sbp_mux **mux,socket_t *sock,uint64_t *fragSize){
+    *ierr=sbpMuxInit(mux,*sock,*fragSize);
+}
+void sbpmuxinit_(int *ierr,sbp_mux **mux,socket_t *sock,uint64_t *fragSize){
+    *ierr=sbpMuxInit(mux,*sock,*fragSize);
+}
+void sbpmuxinit__(int *ierr,sbp_mux **mux,socket_t *sock,uint64_t *fragSize){
+    *ierr=sbpMuxInit(mux,*sock,*fragSize);
+}
+
+int sbpMuxFree(sbp_mux *mux){
+    struct sbp_mux_chan *c,*cNext;
+    if (!mux) return 0;
+    for (c=mux->chans;c;c=cNext){
+        struct sbp_mux_in *in,*inNext;
+        cNext=c->next;
+        for (in=c->recvHead;in;in=inNext){
+            inNext=in->next;
+            free(in->data);
+            free(in);
+        }
+        if (c->partial){
+            free(c->partial->data);
+            free(c->partial);
+        }
+        free(c);
+    }
+    pthread_mutex_destroy(&mux->lock);
+    pthread_cond_destroy(&mux->cond);
+    free(mux->swapBuf);
+    free(mux);
+    return 0;
+}
+/// f77 interface
+void sbpmuxfree(int *ierr,sbp_mux **mux){
+    *ierr=sbpMuxFree(*mux);
+    *mux=NULL;
+}
+void sbpmuxfree_(int *ierr,sbp_mux **mux){
+    *ierr=sbpMuxFree(*mux);
+    *mux=NULL;
+}
+void sbpmuxfree__(int *ierr,sbp_mux **mux){
+    *ierr=sbpMuxFree(*mux);
+    *mux=NULL;
+}
+
+//////// sending ////////
+
+/// writes the next fragment of the channel after lastSent that has something to send
+/// called with the lock held by the writer, releases it during the write
+static void sbpMuxWriteFragment(sbp_mux *mux){
+    struct sbp_mux_chan *c=(mux->lastSent)?mux->lastSent->next:NULL;
+    struct sbp_mux_out *msg;
+    struct iovec iov[2];
+    char header[12+mux_frag_header];
+    const char *data;
+    uint64_t fragLen,offset;
+    int i,err;
+    for (i=0;i<2;++i){ // from lastSent to the end, then from the beginning
+        for (;c;c=c->next){
+            if (c->sendHead) break;
+        }
+        if (c) break;
+        c=mux->chans;
+    }
+    if (!c) return;
+    msg=c->sendHead;
+    offset=msg->sent;
+    fragLen=msg->len-offset;
+    if (fragLen>mux->fragSize) fragLen=mux->fragSize;
+    mux->lastSent=c;
+    sbpEncodeHeader(header,kind_mux_fragment,mux_frag_header+fragLen);
+    sbpMuxPut32(header+12,c->id);
+    sbpMuxPut32(header+16,(uint32_t)msg->kind);
+    sbpMuxPut64(header+20,msg->len);
+    sbpMuxPut64(header+28,offset);
+    pthread_mutex_unlock(&mux->lock);
+    data=msg->data+offset;
+    if (swapBits && msg->elSize==4){
+        sbpCopyInvert4(mux->swapBuf,data,fragLen);
+        data=mux->swapBuf;
+    } else if (swapBits && msg->elSize==8){
+        sbpCopyInvert8(mux->swapBuf,data,fragLen);
+        data=mux->swapBuf;
+    }
+    iov[0].iov_base=header;
+    iov[0].iov_len=sizeof(header);
+    iov[1].iov_base=(void*)data;
+    iov[1].iov_len=(size_t)fragLen;
+    err=sbpWriteAllV(mux->sock,iov,(fragLen>0)?2:1);
+    pthread_mutex_lock(&mux->lock);
+    if (err){
+        mux->err=err;
+        return;
+    }
+    msg->sent+=fragLen;
+    if (msg->sent==msg->len){
+        c->sendHead=msg->next;
+        if (!c->sendHead) c->sendTail=NULL;
+        --c->nSend;
+        msg->done=1;
+        pthread_cond_broadcast(&mux->cond);
+    }
+}
+
+/// fails all the queued messages after a connection error (lock held)
+static void sbpMuxFailSends(sbp_mux *mux){
+    struct sbp_mux_chan *c;
+    for (c=mux->chans;c;c=c->next){
+        struct sbp_mux_out *msg;
+        for (msg=c->sendHead;msg;msg=msg->next){
+            msg->done=1;
+            msg->err=mux->err;
+        }
+        c->sendHead=c->sendTail=NULL;
+        c->nSend=0;
+    }
+    pthread_cond_broadcast(&mux->cond);
+}
+
+/// sends len bytes of p on the given channel as a message of the given kind, elSize is
+/// the size of the elements whose bytes are swapped if needed
+static int sbpMuxSend(sbp_mux *mux,uint32_t channel,int32_t kind,int elSize,const void *p,uint64_t len){
+    struct sbp_mux_out msg;
+    struct sbp_mux_chan *c;
+    memset(&msg,0,sizeof(msg));
+    msg.kind=kind;
+    msg.elSize=elSize;
+    msg.data=(const char*)p;
+    msg.len=len;
+    pthread_mutex_lock(&mux->lock);
+    if (mux->err){
+        pthread_mutex_unlock(&mux->lock);
+        return mux->err;
+    }
+    c=sbpMuxChan(mux,channel);
+    if (!c){
+        pthread_mutex_unlock(&mux->lock);
+        return 2;
+    }
+    if (c->sendTail){
+        c->sendTail->next=&msg;
+    } else {
+        c->sendHead=&msg;
+    }
+    c->sendTail=&msg;
+    ++c->nSend;
+    while (!msg.done){
+        if (!mux->writing){
+            mux->writing=1;
+            while (!msg.done && !mux->err) sbpMuxWriteFragment(mux);
+            if (mux->err) sbpMuxFailSends(mux);
+            mux->writing=0;
+            pthread_cond_broadcast(&mux->cond);
+        } else {
+            pthread_cond_wait(&mux->cond,&mux->lock);
+        }
+    }
+    pthread_mutex_unlock(&mux->lock);
+    return msg.err;
+}
+
+int sbpMuxSend64(sbp_mux *mux,uint32_t channel,int32_t kind,void *p,uint64_t len){
+    return sbpMuxSend(mux,channel,kind,1,p,len);
+}
+
+int sbpMuxSendChars64(sbp_mux *mux,uint32_t channel,char *p,uint64_t len){
+    return sbpMuxSend(mux,channel,kind_char,1,p,len);
+}
+/// f77 interface
+void sbpmuxsendc64n(int *ierr,sbp_mux **mux,uint32_t *channel,char *p,uint64_t len){
+    *ierr=sbpMuxSendChars64(*mux,*channel,p,len);
+}
+void sbpmuxsendc64n_(int *ierr,sbp_mux **mux,uint32_t *channel,char *p,uint64_t len){
+    *ierr=sbpMuxSendChars64(*mux,*channel,p,len);
+}
+void sbpmuxsendc64n__(int *ierr,sbp_mux **mux,uint32_t *channel,char *p,uint64_t len){
+    *ierr=sbpMuxSendChars64(*mux,*channel,p,len);
+}
+
+int sbpMuxSendInt4Array64(sbp_mux *mux,uint32_t channel,void *p,uint64_t len){
+    return sbpMuxSend(mux,channel,kind_int_small,4,p,4*len);
+}
+/// f77 interface
+void sbpmuxsendi64(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxSendInt4Array64(*mux,*channel,p,*len);
+}
+void sbpmuxsendi64_(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxSendInt4Array64(*mux,*channel,p,*len);
+}
+void sbpmuxsendi64__(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxSendInt4Array64(*mux,*channel,p,*len);
+}
+
+int sbpMuxSendDoubleArray64(sbp_mux *mux,uint32_t channel,void *p,uint64_t len){
+    return sbpMuxSend(mux,channel,kind_double_small,8,p,8*len);
+}
+/// f77 interface
+void sbpmuxsendd64(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxSendDoubleArray64(*mux,*channel,p,*len);
+}
+void sbpmuxsendd64_(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxSendDoubleArray64(*mux,*channel,p,*len);
+}
+void sbpmuxsendd64__(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxSendDoubleArray64(*mux,*channel,p,*len);
+}
+
+//////// receiving ////////
+
+/// appends a complete message to the receive queue of its channel (lock held)
+static void sbpMuxDeliver(sbp_mux *mux,struct sbp_mux_chan *c,struct sbp_mux_in *in){
+    if (c->recvTail){
+        c->recvTail->next=in;
+    } else {
+        c->recvHead=in;
+    }
+    c->recvTail=in;
+    ++c->nRecv;
+}
+
+/// reads one message or fragment from the connection, called with the lock held by the
+/// reader, releases it during the reads
+static int sbpMuxReadFrame(sbp_mux *mux){
+    char header[12+mux_frag_header];
+    uint32_t kind,channel,msgKind;
+    uint64_t len,total,offset,fragLen;
+    struct sbp_mux_chan *c;
+    struct sbp_mux_in *in;
+    int err;
+    pthread_mutex_unlock(&mux->lock);
+    err=sbpReadHeader64(mux->sock,&kind,&len);
+    pthread_mutex_lock(&mux->lock);
+    if (err) return 13;
+    if (kind!=kind_mux_fragment){
+        // a normal message, delivered on channel 0
+        c=sbpMuxChan(mux,0);
+        in=(struct sbp_mux_in*)calloc(1,sizeof(struct sbp_mux_in));
+        if (in) in->data=(char*)malloc((size_t)((len>0)?len:1));
+        if (!c || !in || !in->data){
+            if (in) free(in);
+            return 2;
+        }
+        in->kind=kind;
+        in->len=in->filled=len;
+        pthread_mutex_unlock(&mux->lock);
+        err=sbpReadDirect(mux->sock,in->data,len);
+        pthread_mutex_lock(&mux->lock);
+        if (err){
+            free(in->data);
+            free(in);
+            return 12;
+        }
+        sbpMuxDeliver(mux,c,in);
+        return 0;
+    }
+    if (len<mux_frag_header) return 17;
+    pthread_mutex_unlock(&mux->lock);
+    err=sbpReadDirect(mux->sock,header+12,mux_frag_header);
+    pthread_mutex_lock(&mux->lock);
+    if (err) return 12;
+    channel=(uint32_t)sbpMuxGet(header+12,4);
+    msgKind=(uint32_t)sbpMuxGet(header+16,4);
+    total=sbpMuxGet(header+20,8);
+    offset=sbpMuxGet(header+28,8);
+    fragLen=len-mux_frag_header;
+    c=sbpMuxChan(mux,channel);
+    if (!c) return 2;
+    in=c->partial;
+    if (!in){
+        if (offset!=0) return 17;
+        in=(struct sbp_mux_in*)calloc(1,sizeof(struct sbp_mux_in));
+        if (in) in->data=(char*)malloc((size_t)((total>0)?total:1));
+        if (!in || !in->data){
+            if (in) free(in);
+            return 2;
+        }
+        in->kind=msgKind;
+        in->len=total;
+        c->partial=in;
+    }
+    if (in->kind!=msgKind || in->len!=total || in->filled!=offset || fragLen>total-offset){
+        fprintf(stderr,"SBP unexpected mux fragment on channel %u\n",channel);
+        return 17;
+    }
+    pthread_mutex_unlock(&mux->lock);
+    err=sbpReadDirect(mux->sock,in->data+offset,fragLen);
+    pthread_mutex_lock(&mux->lock);
+    if (err) return 12;
+    in->filled+=fragLen;
+    if (in->filled==in->len){
+        c->partial=NULL;
+        sbpMuxDeliver(mux,c,in);
+    }
+    return 0;
+}
+
+/// waits for the next complete message of the channel and removes it from the queue
+/// the bytes of int and double arrays are in the host order
+static int sbpMuxNext(sbp_mux *mux,uint32_t channel,struct sbp_mux_in **res){
+    struct sbp_mux_chan *c;
+    struct sbp_mux_in *in;
+    int elSize;
+    *res=NULL;
+    pthread_mutex_lock(&mux->lock);
+    c=sbpMuxChan(mux,channel);
+    if (!c){
+        pthread_mutex_unlock(&mux->lock);
+        return 2;
+    }
+    while (!c->recvHead && !mux->err){
+        if (!mux->reading){
+            int err;
+            mux->reading=1;
+            err=sbpMuxReadFrame(mux);
+            if (err) mux->err=err;
+            mux->reading=0;
+            pthread_cond_broadcast(&mux->cond);
+        } else {
+            pthread_cond_wait(&mux->cond,&mux->lock);
+        }
+    }
+    in=c->recvHead;
+    if (!in){
+        int err=mux->err;
+        pthread_mutex_unlock(&mux->lock);
+        return err;
+    }
+    c->recvHead=in->next;
+    if (!c->recvHead) c->recvTail=NULL;
+    --c->nRecv;
+    pthread_mutex_unlock(&mux->lock);
+    elSize=sbpMuxElSize(in->kind);
+    if (swapBits && elSize==4) sbpInvert4InPlace(in->data,in->len);
+    if (swapBits && elSize==8) sbpInvert8InPlace(in->data,in->len);
+    *res=in;
+    return 0;
+}
+
+int sbpMuxRecv64(sbp_mux *mux,uint32_t channel,uint32_t *kind,void **data,uint64_t *len){
+    struct sbp_mux_in *in;
+    int err=sbpMuxNext(mux,channel,&in);
+    *data=NULL;
+    *len=0;
+    if (err) return err;
+    *kind=in->kind;
+    *data=in->data;
+    *len=in->len;
+    free(in);
+    return 0;
+}
+
+int sbpMuxReadChars64(sbp_mux *mux,uint32_t channel,char *p,uint64_t *len){
+    struct sbp_mux_in *in;
+    int err=sbpMuxNext(mux,channel,&in);
+    if (err) return err;
+    if (in->kind!=kind_char){
+        err=10;
+    } else if (in->len<=*len){
+        memcpy(p,in->data,(size_t)in->len);
+        if (in->len<*len) p[in->len]=0;
+        *len=in->len;
+    } else {
+        memcpy(p,in->data,(size_t)*len);
+        err=1;
+    }
+    free(in->data);
+    free(in);
+    return err;
+}
+/// f77 interface
+void sbpmuxreadc64n(int *ierr,sbp_mux **mux,uint32_t *channel,char *p,uint64_t len){
+    uint64_t newLen=len;
+    *ierr=sbpMuxReadChars64(*mux,*channel,p,&newLen);
+    if (newLen<len) memset(p+newLen,' ',(size_t)(len-newLen));
+}
+void sbpmuxreadc64n_(int *ierr,sbp_mux **mux,uint32_t *channel,char *p,uint64_t len){
+    sbpmuxreadc64n(ierr,mux,channel,p,len);
+}
+void sbpmuxreadc64n__(int *ierr,sbp_mux **mux,uint32_t *channel,char *p,uint64_t len){
+    sbpmuxreadc64n(ierr,mux,channel,p,len);
+}
+
+/// reads a message of the given kind and exactly byteLen bytes
+static int sbpMuxReadArray(sbp_mux *mux,uint32_t channel,uint32_t kind,void *p,uint64_t byteLen){
+    struct sbp_mux_in *in;
+    int err=sbpMuxNext(mux,channel,&in);
+    if (err) return err;
+    if (in->len!=byteLen){
+        err=15;
+    } else if (in->kind!=kind){
+        err=14;
+    } else {
+        memcpy(p,in->data,(size_t)byteLen);
+    }
+    free(in->data);
+    free(in);
+    return err;
+}
+
+int sbpMuxReadInt4Array64(sbp_mux *mux,uint32_t channel,void *p,uint64_t len){
+    return sbpMuxReadArray(mux,channel,kind_int_small,p,4*len);
+}
+/// f77 interface
+void sbpmuxreadi64(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxReadInt4Array64(*mux,*channel,p,*len);
+}
+void sbpmuxreadi64_(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxReadInt4Array64(*mux,*channel,p,*len);
+}
+void sbpmuxreadi64__(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxReadInt4Array64(*mux,*channel,p,*len);
+}
+
+int sbpMuxReadDoubleArray64(sbp_mux *mux,uint32_t channel,void *p,uint64_t len){
+    return sbpMuxReadArray(mux,channel,kind_double_small,p,8*len);
+}
+/// f77 interface
+void sbpmuxreadd64(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxReadDoubleArray64(*mux,*channel,p,*len);
+}
+void sbpmuxreadd64_(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxReadDoubleArray64(*mux,*channel,p,*len);
+}
+void sbpmuxreadd64__(int *ierr,sbp_mux **mux,uint32_t *channel,void *p,uint64_t *len){
+    *ierr=sbpMuxReadDoubleArray64(*mux,*channel,p,*len);
+}
+
+int sbpMuxQueued(sbp_mux *mux,uint32_t channel,uint64_t *nSend,uint64_t *nRecv){
+    struct sbp_mux_chan *c;
+    pthread_mutex_lock(&mux->lock);
+    c=sbpMuxChan(mux,channel);
+    *nSend=(c)?c->nSend:0;
+    *nRecv=(c)?c->nRecv:0;
+    pthread_mutex_unlock(&mux->lock);
+    return (c)?0:2;
+}
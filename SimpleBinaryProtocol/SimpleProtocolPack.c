@@ -0,0 +1,422 @@
+/// packed (compressed) payloads for the simple binary protocol
+/// large int and double arrays sent to a peer that accepted sbp_cap_packed in the
+/// connection handshake are sent as kind_int_packed/kind_double_packed messages, and
+/// the sbpRead*Array functions unpack them transparently.
+///
+/// The length in the header is the unpacked length, the payload is a sequence of
+/// chunks (of at most pack_chunk unpacked bytes), each one with an 8 bytes header
+/// (unpacked length, packed length, 4 bytes small endian each) and the packed data,
+/// or the unpacked data as is if the packed length is 0 (incompressible chunk).
+/// Chunks are transformed on their small endian bytes before the LZ compression:
+/// doubles are xored with the previous value and byte shuffled (the bytes with the
+/// same significance are grouped), ints are byte shuffled, raw data is untouched.
+/// The LZ format is the one of lz4 blocks (token with literal and match length
+/// nibbles, literals, 2 bytes offset, minimum match 4), the last sequence has no match.
+/// Chunks are handed to the socket as soon as they are packed, so the transmission
+/// of one chunk overlaps with the packing of the next (and likewise when reading).
+/// author: fawzi
+//
+// Copyright 2008-2010 the blip developer group
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// this file is explicitly released also with GPLv2 for the projects that might need it
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "SimpleProtocol.h"
+
+enum SBP_PACK_SIZES{
+    pack_chunk=262144,          // unpacked bytes per chunk (multiple of 8)
+    pack_default_min=65536,     // smaller messages are sent unpacked
+    pack_hash_bits=14,          // log2 of the entries of the match finder table
+    pack_min_match=4,
+    pack_last_literals=5        // bytes at the end of a chunk that are always literals
+};
+
+// from SimpleProtocol.c
+extern int swapBits;
+int sbpWriteAllV(socket_t sock,struct iovec *iov,size_t iovcnt);
+int sbpReadDirect(socket_t sock,void* start,uint64_t len);
+
+int sbpPackEnabled=0;
+uint64_t sbpPackMinLen=pack_default_min;
+/// the sockets whose peer accepted packed payloads, indexed by socket
+/// (size and flags in one block published atomically, old blocks are never freed)
+typedef struct sbp_pack_table{
+    size_t size;
+    unsigned char peers[];
+} sbp_pack_table;
+sbp_pack_table *sbpPackPeers=NULL;
+pthread_mutex_t sbpPackPeersLock=PTHREAD_MUTEX_INITIALIZER;
+
+int sbpPackEnable(int enable,uint64_t minLen){
+    sbpPackMinLen=(minLen==0)?pack_default_min:minLen;
+    sbpPackEnabled=(enable!=0);
+    return 0;
+}
+/// f77 interface
+void sbppackenable(int*ierr,int*enable,uint64_t*minLen){
+    *ierr=sbpPackEnable(*enable,*minLen);
+}
+void sbppackenable_(int*ierr,int*enable,uint64_t*minLen){
+    *ierr=sbpPackEnable(*enable,*minLen);
+}
+void sbppackenable__(int*ierr,int*enable,uint64_t*minLen){
+    *ierr=sbpPackEnable(*enable,*minLen);
+}
+
+int sbpPackActive(socket_t sock){
+    sbp_pack_table *table=__atomic_load_n(&sbpPackPeers,__ATOMIC_ACQUIRE);
+    if (table && sock>=0 && (size_t)sock<table->size){
+        return __atomic_load_n(&table->peers[sock],__ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/// records if the peer of sock accepted packed payloads
+void sbpPackSetPeer(socket_t sock,int packed){
+    if (sock<0) return;
+    pthread_mutex_lock(&sbpPackPeersLock);
+    if (!sbpPackPeers || (size_t)sock>=sbpPackPeers->size){
+        size_t oldSize=(sbpPackPeers)?sbpPackPeers->size:0;
+        size_t newSize=(oldSize>0)?2*oldSize:64;
+        sbp_pack_table *newPeers;
+        if (!packed){
+            pthread_mutex_unlock(&sbpPackPeersLock);
+            return;
+        }
+        while (newSize<=(size_t)sock) newSize*=2;
+        newPeers=(sbp_pack_table*)calloc(sizeof(sbp_pack_table)+newSize,1);
+        if (!newPeers){
+            pthread_mutex_unlock(&sbpPackPeersLock);
+            return;
+        }
+        newPeers->size=newSize;
+        if (oldSize>0) memcpy(newPeers->peers,sbpPackPeers->peers,oldSize);
+        __atomic_store_n(&sbpPackPeers,newPeers,__ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&sbpPackPeers->peers[sock],(unsigned char)(packed!=0),__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sbpPackPeersLock);
+}
+
+/// true if an array of byteLen bytes sent to sock should be packed
+int sbpPackUse(socket_t sock,uint64_t byteLen){
+    return byteLen>=sbpPackMinLen && sbpPackActive(sock);
+}
+
+//////// transforms ////////
+
+/// groups the bytes of the same significance of the elements of src
+static void sbpShuffle(unsigned char *dst,const unsigned char *src,size_t n,int elSize){
+    size_t nEl=n/elSize,i;
+    int b;
+    for (b=0;b<elSize;++b){
+        unsigned char *d=dst+b*nEl;
+        const unsigned char *s=src+b;
+        for (i=0;i<nEl;++i) d[i]=s[i*elSize];
+    }
+}
+
+static void sbpUnshuffle(unsigned char *dst,const unsigned char *src,size_t n,int elSize){
+    size_t nEl=n/elSize,i;
+    int b;
+    for (b=0;b<elSize;++b){
+        const unsigned char *s=src+b*nEl;
+        unsigned char *d=dst+b;
+        for (i=0;i<nEl;++i) d[i*elSize]=s[i];
+    }
+}
+
+/// xors each 8 bytes element with the previous one (the xor is byte wise, so the
+/// result does not depend on the endianness)
+static void sbpXorDelta8(unsigned char *dst,const unsigned char *src,size_t n){
+    uint64_t prev=0,v,d;
+    size_t i;
+    for (i=0;i+8<=n;i+=8){
+        memcpy(&v,src+i,8);
+        d=v^prev;
+        memcpy(dst+i,&d,8);
+        prev=v;
+    }
+}
+
+static void sbpXorUndelta8(unsigned char *buf,size_t n){
+    uint64_t prev=0,v;
+    size_t i;
+    for (i=0;i+8<=n;i+=8){
+        memcpy(&v,buf+i,8);
+        prev^=v;
+        memcpy(buf+i,&prev,8);
+    }
+}
+
+//////// lz codec ////////
+
+/// appends a length extension (the part of len exceeding a full nibble)
+static inline unsigned char *sbpLzPutLen(unsigned char *op,size_t len){
+    while (len>=255){
+        *op++=255;
+        len-=255;
+    }
+    *op++=(unsigned char)len;
+    return op;
+}
+
+/// emits a sequence (mLen==0 for the last one), returns NULL if it does not fit
+static unsigned char *sbpLzEmit(unsigned char *op,unsigned char *opEnd,const unsigned char *lit,
+    size_t litLen,size_t offset,size_t mLen)
+{
+    size_t need=1+litLen+(litLen>=15?litLen/255+1:0)+(mLen?2+((mLen-pack_min_match)>=15?(mLen-pack_min_match)/255+1:0):0);
+    unsigned char *token=op;
+    if ((size_t)(opEnd-op)<need) return NULL;
+    ++op;
+    *token=(unsigned char)((litLen>=15?15:litLen)<<4);
+    if (litLen>=15) op=sbpLzPutLen(op,litLen-15);
+    memcpy(op,lit,litLen);
+    op+=litLen;
+    if (mLen){
+        size_t m=mLen-pack_min_match;
+        *op++=(unsigned char)(offset&0xff);
+        *op++=(unsigned char)(offset>>8);
+        *token|=(unsigned char)(m>=15?15:m);
+        if (m>=15) op=sbpLzPutLen(op,m-15);
+    }
+    return op;
+}
+
+/// compresses n bytes of src to dst, returns the compressed size, or 0 if it would
+/// need more than dstCap bytes; table needs 1<<pack_hash_bits entries
+static size_t sbpLzCompress(const unsigned char *src,size_t n,unsigned char *dst,size_t dstCap,
+    uint32_t *table)
+{
+    size_t ip=0,anchor=0;
+    unsigned char *op=dst,*opEnd=dst+dstCap;
+    memset(table,0,sizeof(uint32_t)<<pack_hash_bits);
+    while (ip+pack_min_match+pack_last_literals<=n){
+        uint32_t seq,h,cand;
+        memcpy(&seq,src+ip,4);
+        h=(seq*2654435761U)>>(32-pack_hash_bits);
+        cand=table[h];
+        table[h]=(uint32_t)ip+1;
+        if (cand>0 && ip-(cand-1)<=65535 && memcmp(src+cand-1,src+ip,4)==0){
+            size_t ref=cand-1,mLen=pack_min_match,maxLen=n-pack_last_literals-ip;
+            while (mLen<maxLen && src[ref+mLen]==src[ip+mLen]) ++mLen;
+            op=sbpLzEmit(op,opEnd,src+anchor,ip-anchor,ip-ref,mLen);
+            if (!op) return 0;
+            ip+=mLen;
+            anchor=ip;
+            continue;
+        }
+        // skip faster through incompressible data
+        ip+=1+((ip-anchor)>>6);
+    }
+    op=sbpLzEmit(op,opEnd,src+anchor,n-anchor,0,0);
+    if (!op) return 0;
+    return (size_t)(op-dst);
+}
+
+/// decompresses n bytes of src that should give exactly rawLen bytes in dst
+/// returns 0 if successful
+static int sbpLzDecompress(const unsigned char *src,size_t n,unsigned char *dst,size_t rawLen){
+    size_t ip=0,op=0;
+    while (1){
+        size_t litLen,mLen,offset;
+        unsigned char token,b;
+        if (ip>=n) return 1;
+        token=src[ip++];
+        litLen=token>>4;
+        if (litLen==15){
+            do {
+                if (ip>=n) return 1;
+                b=src[ip++];
+                litLen+=b;
+            } while (b==255);
+        }
+        if (litLen>n-ip || litLen>rawLen-op) return 2;
+        memcpy(dst+op,src+ip,litLen);
+        ip+=litLen;
+        op+=litLen;
+        if (ip==n) break; // last sequence
+        if (n-ip<2) return 3;
+        offset=(size_t)src[ip]|((size_t)src[ip+1]<<8);
+        ip+=2;
+        if (offset==0 || offset>op) return 4;
+        mLen=token&15;
+        if (mLen==15){
+            do {
+                if (ip>=n) return 1;
+                b=src[ip++];
+                mLen+=b;
+            } while (b==255);
+        }
+        mLen+=pack_min_match;
+        if (mLen>rawLen-op) return 5;
+        if (offset>=mLen){
+            memcpy(dst+op,dst+op-offset,mLen);
+        } else {
+            size_t i;
+            for (i=0;i<mLen;++i) dst[op+i]=dst[op-offset+i];
+        }
+        op+=mLen;
+    }
+    return (op==rawLen)?0:6;
+}
+
+//////// sending and receiving ////////
+
+/// element size of the transform of the packed kind
+static int sbpPackElSize(int32_t kind){
+    switch (kind){
+    case kind_int_packed: return 4;
+    case kind_double_packed: return 8;
+    default: return 1;
+    }
+}
+
+static void sbpPackPut32(unsigned char *p,uint32_t v){
+    p[0]=(unsigned char)v;
+    p[1]=(unsigned char)(v>>8);
+    p[2]=(unsigned char)(v>>16);
+    p[3]=(unsigned char)(v>>24);
+}
+
+static uint32_t sbpPackGet32(const unsigned char *p){
+    return (uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+int sbpSendPacked64(socket_t sock,int32_t kind,void *p,uint64_t byteLen){
+    int elSize=sbpPackElSize(kind);
+    unsigned char *buf,*le,*tr,*out;
+    uint32_t *table;
+    uint64_t off;
+    int err=0;
+    if (byteLen%elSize!=0) return 4;
+    buf=(unsigned char*)malloc(3*(size_t)pack_chunk+8+(sizeof(uint32_t)<<pack_hash_bits));
+    if (!buf) return 2;
+    le=buf;
+    tr=buf+pack_chunk;
+    out=buf+2*(size_t)pack_chunk;
+    table=(uint32_t*)(buf+3*(size_t)pack_chunk+8);
+    if (sbpSendHeader64(sock,kind,byteLen)!=0){
+        free(buf);
+        return 3;
+    }
+    for (off=0;off<byteLen && !err;off+=pack_chunk){
+        size_t n=(byteLen-off<pack_chunk)?(size_t)(byteLen-off):(size_t)pack_chunk,packedLen;
+        const unsigned char *src=(const unsigned char*)p+off,*toPack=src;
+        struct iovec iov[2];
+        if (swapBits && elSize>1){
+            if (elSize==4){
+                sbpCopyInvert4(le,src,n);
+            } else {
+                sbpCopyInvert8(le,src,n);
+            }
+            src=le;
+        }
+        if (elSize==8){
+            sbpXorDelta8(out+8,src,n);
+            sbpShuffle(tr,out+8,n,8);
+            toPack=tr;
+        } else if (elSize==4){
+            sbpShuffle(tr,src,n,4);
+            toPack=tr;
+        }
+        packedLen=sbpLzCompress(toPack,n,out+8,n-1,table);
+        sbpPackPut32(out,(uint32_t)n);
+        sbpPackPut32(out+4,(uint32_t)packedLen);
+        iov[0].iov_base=out;
+        if (packedLen==0){
+            iov[0].iov_len=8;
+            iov[1].iov_base=(void*)src;
+            iov[1].iov_len=n;
+            err=sbpWriteAllV(sock,iov,2);
+        } else {
+            iov[0].iov_len=8+packedLen;
+            err=sbpWriteAllV(sock,iov,1);
+        }
+    }
+    free(buf);
+    return err;
+}
+/// f77 interface
+void sbpsendpacked64(int*ierr,socket_t*sock,int32_t*kind,void*p,uint64_t*byteLen){
+    *ierr=sbpSendPacked64(*sock,*kind,p,*byteLen);
+}
+void sbpsendpacked64_(int*ierr,socket_t*sock,int32_t*kind,void*p,uint64_t*byteLen){
+    *ierr=sbpSendPacked64(*sock,*kind,p,*byteLen);
+}
+void sbpsendpacked64__(int*ierr,socket_t*sock,int32_t*kind,void*p,uint64_t*byteLen){
+    *ierr=sbpSendPacked64(*sock,*kind,p,*byteLen);
+}
+
+int sbpReadPacked64(socket_t sock,int32_t kind,void *p,uint64_t byteLen){
+    int elSize=sbpPackElSize(kind);
+    unsigned char *buf,*in,*tr,*dst;
+    uint64_t off;
+    int err=0;
+    buf=(unsigned char*)malloc(2*(size_t)pack_chunk);
+    if (!buf) return 2;
+    in=buf;
+    tr=buf+pack_chunk;
+    for (off=0;off<byteLen && !err;){
+        unsigned char chunkHeader[8];
+        uint32_t n,packedLen;
+        if (sbpReadDirect(sock,chunkHeader,8)!=0){
+            err=13;
+            break;
+        }
+        n=sbpPackGet32(chunkHeader);
+        packedLen=sbpPackGet32(chunkHeader+4);
+        if (n==0 || n>pack_chunk || n>byteLen-off || n%elSize!=0 || packedLen>=n){
+            fprintf(stderr,"SBP invalid packed chunk (%u->%u bytes)\n",packedLen,n);
+            err=17;
+            break;
+        }
+        dst=(unsigned char*)p+off;
+        if (packedLen==0){
+            if (sbpReadDirect(sock,dst,n)!=0) err=12;
+        } else if (sbpReadDirect(sock,in,packedLen)!=0){
+            err=12;
+        } else if (sbpLzDecompress(in,packedLen,(elSize>1)?tr:dst,n)!=0){
+            fprintf(stderr,"SBP corrupted packed chunk\n");
+            err=17;
+        } else if (elSize>1){
+            sbpUnshuffle(dst,tr,n,elSize);
+            if (elSize==8) sbpXorUndelta8(dst,n);
+        }
+        if (!err && swapBits && elSize>1){
+            if (elSize==4){
+                sbpInvert4InPlace(dst,n);
+            } else {
+                sbpInvert8InPlace(dst,n);
+            }
+        }
+        off+=n;
+    }
+    free(buf);
+    return err;
+}
+
+int sbpSendInt4ArrayPacked64(socket_t sock,void *p,uint64_t len){
+    return sbpSendPacked64(sock,kind_int_packed,p,4UL*len);
+}
+
+int sbpSendDoubleArrayPacked64(socket_t sock,void *p,uint64_t len){
+    return sbpSendPacked64(sock,kind_double_packed,p,8UL*len);
+}
@@ -0,0 +1,608 @@
+/// event driven server for the simple binary protocol
+/// a single thread waits (with epoll on linux, poll elsewhere) on the listening sockets
+/// and on all the connections, connections with incoming data are handed to a small
+/// fixed pool of workers that read the messages incrementally from the non blocking
+/// socket and call the callback registered for their kind.
+/// A connection is owned by at most one worker at a time, so the messages of a
+/// connection are handled in order, and replies sent from the callbacks do not interleave.
+/// author: fawzi
+//
+// Copyright 2008-2010 the blip developer group
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// this file is explicitly released also with GPLv2 for the projects that might need it
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "SimpleProtocol.h"
+#ifdef __linux__
+#define SBP_USE_EPOLL 1
+#include <sys/epoll.h>
+#endif
+
+enum SBP_SERVER_SIZES{
+    server_max_listen=10,
+    server_in_buf_size=65536,     // read ahead buffer of each connection
+    server_max_msg_per_turn=64,   // messages handled before giving other connections a chance
+    server_keep_payload=1048576,  // larger payload buffers are freed after use
+    server_max_events=256
+};
+
+enum SBP_CONN_STATE{
+    conn_header=0,
+    conn_payload=1
+};
+
+// from SimpleProtocol.c
+extern int swapBits;
+void sbpDecodeHeader(char *bufPos, uint32_t *kind, uint64_t *len);
+int sbpListeningSocketsOf(socket_t sock,socket_t *socks,int maxSocks);
+int sbpFormatAddress(struct sockaddr *address,socklen_t addrLen,char*addrStr,uint32_t *addrStrLen);
+
+/// a connection, with the state of the message being read
+struct sbp_conn{
+    socket_t sock;
+    int state;
+    char header[12];
+    size_t headerPos;
+    uint32_t kind;
+    uint64_t len;
+    char *payload;
+    size_t payloadCapacity;
+    uint64_t payloadPos;
+    char *inBuf;
+    size_t inStart,inEnd;
+    void *connData;
+    int armed;                  // waiting for events (poll fallback)
+    struct sbp_conn *nextReady; // link in the work queue
+    struct sbp_conn *prev,*next; // list of all connections
+    char addr[128];
+};
+
+struct sbp_server{
+    sbp_server_config config;
+    socket_t listenSocks[server_max_listen];
+    int nListen;
+    int wakePipe[2];
+    volatile int stop;
+#ifdef SBP_USE_EPOLL
+    int epollFd;
+#endif
+    pthread_mutex_t lock;       // protects the work queue and the connection list
+    pthread_cond_t workAvailable;
+    struct sbp_conn *readyFirst,*readyLast;
+    struct sbp_conn *conns;
+    size_t nConns;
+    pthread_t *workers;
+    int nWorkersStarted;
+};
+
+int sbpSetNonBlocking(socket_t sock){
+    int flags=fcntl(sock,F_GETFL,0);
+    if (flags<0 || fcntl(sock,F_SETFL,flags|O_NONBLOCK)<0){
+        perror("SBP error setting socket non blocking");
+        return 1;
+    }
+    return 0;
+}
+
+/// wakes up the event loop (used to stop it and, with poll, to rearm connections)
+static void sbpServerWake(sbp_server *srv){
+    char c=0;
+    while (write(srv->wakePipe[1],&c,1)<0 && errno==EINTR){}
+}
+
+/// makes the event loop wait again for data on the connection
+static void sbpServerArm(sbp_server *srv,struct sbp_conn *conn){
+#ifdef SBP_USE_EPOLL
+    struct epoll_event ev;
+    memset(&ev,0,sizeof(ev));
+    ev.events=EPOLLIN|EPOLLONESHOT;
+    ev.data.ptr=conn;
+    if (epoll_ctl(srv->epollFd,EPOLL_CTL_MOD,conn->sock,&ev)!=0){
+        perror("SBP error rearming connection");
+    }
+#else
+    pthread_mutex_lock(&srv->lock);
+    conn->armed=1;
+    pthread_mutex_unlock(&srv->lock);
+    sbpServerWake(srv);
+#endif
+}
+
+static void sbpServerEnqueue(sbp_server *srv,struct sbp_conn *conn){
+    pthread_mutex_lock(&srv->lock);
+    conn->nextReady=NULL;
+    if (srv->readyLast){
+        srv->readyLast->nextReady=conn;
+    } else {
+        srv->readyFirst=conn;
+    }
+    srv->readyLast=conn;
+    pthread_cond_signal(&srv->workAvailable);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+/// removes the connection from the server, closes and frees it
+static void sbpServerDropConn(sbp_server *srv,struct sbp_conn *conn){
+    if (srv->config.onClose){
+        srv->config.onClose(conn->sock,&conn->connData,srv->config.ctx);
+    }
+#ifdef SBP_USE_EPOLL
+    epoll_ctl(srv->epollFd,EPOLL_CTL_DEL,conn->sock,NULL);
+#endif
+    pthread_mutex_lock(&srv->lock);
+    if (conn->prev){
+        conn->prev->next=conn->next;
+    } else {
+        srv->conns=conn->next;
+    }
+    if (conn->next) conn->next->prev=conn->prev;
+    --srv->nConns;
+    pthread_mutex_unlock(&srv->lock);
+    close(conn->sock);
+    free(conn->payload);
+    free(conn->inBuf);
+    free(conn);
+}
+
+/// calls the handler for the message that was just completed, returns non 0 if the
+/// connection should be closed
+static int sbpServerDispatch(sbp_server *srv,struct sbp_conn *conn){
+    sbp_message msg;
+    sbp_msg_handler handler=NULL;
+    int res;
+    if (swapBits){
+        if (conn->kind==kind_int_small){
+            sbpInvert4InPlace(conn->payload,conn->len);
+        } else if (conn->kind==kind_double_small){
+            sbpInvert8InPlace(conn->payload,conn->len);
+        }
+    }
+    if (conn->kind==kind_handshake){
+        // no capability (shared memory, packed payloads) is supported here
+        char answer[8]={(char)sbp_cap_reply,0,0,0,0,0,0,0};
+        if (conn->len>=1 && (conn->payload[0]&sbp_cap_reply)) return 0; // a stray answer
+        if (sbpSendHeader64(conn->sock,kind_handshake,8)!=0) return 1;
+        return sbpSendCharsPiece64(conn->sock,answer,8)!=0;
+    }
+    if (conn->kind<sbp_server_max_kinds) handler=srv->config.handlers[conn->kind];
+    if (!handler) handler=srv->config.defaultHandler;
+    if (!handler){
+        fprintf(stderr,"SBP server has no handler for kind %d, closing connection %d\n",
+            (int)conn->kind,conn->sock);
+        return 1;
+    }
+    msg.sock=conn->sock;
+    msg.kind=conn->kind;
+    msg.len=conn->len;
+    msg.data=conn->payload;
+    msg.connData=&conn->connData;
+    res=handler(&msg,srv->config.ctx);
+    if (conn->payloadCapacity>server_keep_payload){
+        free(conn->payload);
+        conn->payload=NULL;
+        conn->payloadCapacity=0;
+    }
+    return res;
+}
+
+/// advances the state machine with the data in the read ahead buffer
+/// returns 1 if a message is complete, 0 if more data is needed, <0 on errors
+static int sbpConnParse(sbp_server *srv,struct sbp_conn *conn){
+    if (conn->state==conn_header){
+        size_t n=12-conn->headerPos;
+        if (n>conn->inEnd-conn->inStart) n=conn->inEnd-conn->inStart;
+        memcpy(conn->header+conn->headerPos,conn->inBuf+conn->inStart,n);
+        conn->headerPos+=n;
+        conn->inStart+=n;
+        if (conn->headerPos<12) return 0;
+        sbpDecodeHeader(conn->header,&conn->kind,&conn->len);
+        if (srv->config.maxMessageSize && conn->len>srv->config.maxMessageSize){
+            fprintf(stderr,"SBP server message of %ld bytes on connection %d is too large\n",
+                (long)conn->len,conn->sock);
+            return -2;
+        }
+        if (conn->len>conn->payloadCapacity || !conn->payload){
+            char *newPayload=(char*)realloc(conn->payload,(size_t)(conn->len?conn->len:1));
+            if (!newPayload) return -3;
+            conn->payload=newPayload;
+            conn->payloadCapacity=(size_t)(conn->len?conn->len:1);
+        }
+        conn->payloadPos=0;
+        conn->headerPos=0;
+        conn->state=conn_payload;
+    }
+    if (conn->state==conn_payload){
+        uint64_t n=conn->len-conn->payloadPos;
+        if (n>conn->inEnd-conn->inStart) n=conn->inEnd-conn->inStart;
+        memcpy(conn->payload+conn->payloadPos,conn->inBuf+conn->inStart,(size_t)n);
+        conn->payloadPos+=n;
+        conn->inStart+=(size_t)n;
+        if (conn->payloadPos<conn->len) return 0;
+        conn->state=conn_header;
+        return 1;
+    }
+    return 0;
+}
+
+/// handles the connection until no more data is available (or its turn is over)
+static void sbpServerProcess(sbp_server *srv,struct sbp_conn *conn){
+    int nMsg=0;
+    while (1){
+        ssize_t readB;
+        int res;
+        while ((res=sbpConnParse(srv,conn))==1){
+            if (sbpServerDispatch(srv,conn)!=0){
+                sbpServerDropConn(srv,conn);
+                return;
+            }
+            ++nMsg;
+        }
+        if (res<0){
+            sbpServerDropConn(srv,conn);
+            return;
+        }
+        if (srv->stop) return;
+        if (nMsg>=server_max_msg_per_turn){
+            if (conn->inStart<conn->inEnd){
+                sbpServerEnqueue(srv,conn); // buffered data, the event loop would not see it
+            } else {
+                sbpServerArm(srv,conn);
+            }
+            return;
+        }
+        conn->inStart=0;
+        conn->inEnd=0;
+        if (conn->state==conn_payload && conn->len-conn->payloadPos>=server_in_buf_size){
+            // large payloads are read directly to their final place
+            readB=recv(conn->sock,conn->payload+conn->payloadPos,
+                (size_t)(conn->len-conn->payloadPos),0);
+            if (readB>0){
+                conn->payloadPos+=(uint64_t)readB;
+                if (conn->payloadPos==conn->len){
+                    conn->state=conn_header;
+                    if (sbpServerDispatch(srv,conn)!=0){
+                        sbpServerDropConn(srv,conn);
+                        return;
+                    }
+                    ++nMsg;
+                }
+                continue;
+            }
+        } else {
+            readB=recv(conn->sock,conn->inBuf,server_in_buf_size,0);
+            if (readB>0){
+                conn->inEnd=(size_t)readB;
+                continue;
+            }
+        }
+        if (readB<0 && errno==EINTR) continue;
+        if (readB<0 && (errno==EAGAIN || errno==EWOULDBLOCK)){
+            sbpServerArm(srv,conn);
+            return;
+        }
+        if (readB<0) perror("SBP server error reading from connection");
+        sbpServerDropConn(srv,conn); // EOF or error
+        return;
+    }
+}
+
+static void *sbpServerWorker(void *srvP){
+    sbp_server *srv=(sbp_server*)srvP;
+    while (1){
+        struct sbp_conn *conn;
+        pthread_mutex_lock(&srv->lock);
+        while (!srv->readyFirst && !srv->stop){
+            pthread_cond_wait(&srv->workAvailable,&srv->lock);
+        }
+        if (srv->stop){
+            pthread_mutex_unlock(&srv->lock);
+            return NULL;
+        }
+        conn=srv->readyFirst;
+        srv->readyFirst=conn->nextReady;
+        if (!srv->readyFirst) srv->readyLast=NULL;
+        pthread_mutex_unlock(&srv->lock);
+        sbpServerProcess(srv,conn);
+    }
+}
+
+/// accepts all the pending connections on the given listening socket
+static void sbpServerAccept(sbp_server *srv,socket_t lSock){
+    while (1){
+        struct sockaddr_storage address;
+        socklen_t addrLen=(socklen_t)sizeof(address);
+        uint32_t addrStrLen;
+        struct sbp_conn *conn;
+        socket_t newSock=accept(lSock,(struct sockaddr*)&address,&addrLen);
+        if (newSock<0){
+            if (errno==EINTR) continue;
+            if (errno!=EAGAIN && errno!=EWOULDBLOCK) perror("SBP server accepting socket");
+            return;
+        }
+        conn=(struct sbp_conn*)calloc(1,sizeof(struct sbp_conn));
+        if (!conn || sbpSetNonBlocking(newSock)!=0){
+            free(conn);
+            close(newSock);
+            continue;
+        }
+        conn->inBuf=(char*)malloc(server_in_buf_size);
+        if (!conn->inBuf){
+            free(conn);
+            close(newSock);
+            continue;
+        }
+        conn->sock=newSock;
+        conn->state=conn_header;
+        addrStrLen=(uint32_t)sizeof(conn->addr)-1;
+        sbpFormatAddress((struct sockaddr*)&address,addrLen,conn->addr,&addrStrLen);
+        conn->addr[addrStrLen]=0;
+        if (srv->config.onConnect &&
+            srv->config.onConnect(newSock,conn->addr,&conn->connData,srv->config.ctx)!=0)
+        {
+            close(newSock);
+            free(conn->inBuf);
+            free(conn);
+            continue;
+        }
+        pthread_mutex_lock(&srv->lock);
+        conn->next=srv->conns;
+        if (srv->conns) srv->conns->prev=conn;
+        srv->conns=conn;
+        ++srv->nConns;
+        conn->armed=1;
+        pthread_mutex_unlock(&srv->lock);
+#ifdef SBP_USE_EPOLL
+        {
+            struct epoll_event ev;
+            memset(&ev,0,sizeof(ev));
+            ev.events=EPOLLIN|EPOLLONESHOT;
+            ev.data.ptr=conn;
+            if (epoll_ctl(srv->epollFd,EPOLL_CTL_ADD,newSock,&ev)!=0){
+                perror("SBP server registering connection");
+                sbpServerDropConn(srv,conn);
+            }
+        }
+#endif
+    }
+}
+
+/// hands a ready connection to the workers (or handles it directly without workers)
+static void sbpServerReady(sbp_server *srv,struct sbp_conn *conn){
+    if (srv->nWorkersStarted>0){
+        sbpServerEnqueue(srv,conn);
+    } else {
+        sbpServerProcess(srv,conn);
+        while (srv->readyFirst){ // connections requeued because their turn was over
+            struct sbp_conn *c=srv->readyFirst;
+            srv->readyFirst=c->nextReady;
+            if (!srv->readyFirst) srv->readyLast=NULL;
+            sbpServerProcess(srv,c);
+        }
+    }
+}
+
+int sbpServerCreate(sbp_server **server,socket_t listenSock,sbp_server_config *config){
+    sbp_server *srv;
+    int i;
+    *server=NULL;
+    srv=(sbp_server*)calloc(1,sizeof(sbp_server));
+    if (!srv) return 1;
+    memcpy(&srv->config,config,sizeof(sbp_server_config));
+    srv->nListen=sbpListeningSocketsOf(listenSock,srv->listenSocks,server_max_listen);
+    if (srv->nListen<0){
+        srv->listenSocks[0]=listenSock; // a plain system socket
+        srv->nListen=1;
+    }
+    if (pipe(srv->wakePipe)!=0){
+        perror("SBP server pipe");
+        free(srv);
+        return 2;
+    }
+    sbpSetNonBlocking(srv->wakePipe[0]);
+    for (i=0;i<srv->nListen;++i){
+        sbpSetNonBlocking(srv->listenSocks[i]);
+    }
+    pthread_mutex_init(&srv->lock,NULL);
+    pthread_cond_init(&srv->workAvailable,NULL);
+#ifdef SBP_USE_EPOLL
+    srv->epollFd=epoll_create(server_max_events);
+    if (srv->epollFd<0){
+        perror("SBP server epoll_create");
+        sbpServerFree(srv);
+        return 3;
+    }
+    {
+        struct epoll_event ev;
+        memset(&ev,0,sizeof(ev));
+        ev.events=EPOLLIN;
+        ev.data.ptr=NULL; // the wake pipe
+        epoll_ctl(srv->epollFd,EPOLL_CTL_ADD,srv->wakePipe[0],&ev);
+        for (i=0;i<srv->nListen;++i){
+            // listening sockets are marked by pointers in listenSocks
+            ev.data.ptr=&srv->listenSocks[i];
+            if (epoll_ctl(srv->epollFd,EPOLL_CTL_ADD,srv->listenSocks[i],&ev)!=0){
+                perror("SBP server registering listening socket");
+                sbpServerFree(srv);
+                return 4;
+            }
+        }
+    }
+#endif
+    *server=srv;
+    return 0;
+}
+
+#ifdef SBP_USE_EPOLL
+static int sbpServerLoop(sbp_server *srv){
+    struct epoll_event events[server_max_events];
+    while (!srv->stop){
+        int nEv=epoll_wait(srv->epollFd,events,server_max_events,-1),i;
+        if (nEv<0){
+            if (errno==EINTR) continue;
+            perror("SBP server epoll_wait");
+            return 5;
+        }
+        for (i=0;i<nEv;++i){
+            void *ptr=events[i].data.ptr;
+            if (ptr==NULL){
+                char buf[64];
+                while (read(srv->wakePipe[0],buf,sizeof(buf))>0){}
+            } else if ((socket_t*)ptr>=srv->listenSocks && (socket_t*)ptr<srv->listenSocks+srv->nListen){
+                sbpServerAccept(srv,*(socket_t*)ptr);
+            } else {
+                sbpServerReady(srv,(struct sbp_conn*)ptr);
+            }
+        }
+    }
+    return 0;
+}
+#else
+static int sbpServerLoop(sbp_server *srv){
+    struct pollfd *fds=NULL;
+    struct sbp_conn **fdConns=NULL;
+    size_t fdsCapacity=0;
+    while (!srv->stop){
+        size_t nFds=0,i;
+        struct sbp_conn *conn;
+        int nEv;
+        pthread_mutex_lock(&srv->lock);
+        if (fdsCapacity<srv->nConns+srv->nListen+1){
+            fdsCapacity=2*(srv->nConns+srv->nListen+1);
+            fds=(struct pollfd*)realloc(fds,fdsCapacity*sizeof(struct pollfd));
+            fdConns=(struct sbp_conn**)realloc(fdConns,fdsCapacity*sizeof(struct sbp_conn*));
+        }
+        fds[nFds].fd=srv->wakePipe[0];
+        fds[nFds].events=POLLIN;
+        fdConns[nFds]=NULL;
+        ++nFds;
+        for (i=0;i<(size_t)srv->nListen;++i){
+            fds[nFds].fd=srv->listenSocks[i];
+            fds[nFds].events=POLLIN;
+            fdConns[nFds]=NULL;
+            ++nFds;
+        }
+        for (conn=srv->conns;conn;conn=conn->next){
+            if (!conn->armed) continue;
+            fds[nFds].fd=conn->sock;
+            fds[nFds].events=POLLIN;
+            fdConns[nFds]=conn;
+            ++nFds;
+        }
+        pthread_mutex_unlock(&srv->lock);
+        for (i=0;i<nFds;++i) fds[i].revents=0;
+        nEv=poll(fds,(nfds_t)nFds,-1);
+        if (nEv<0){
+            if (errno==EINTR) continue;
+            perror("SBP server poll");
+            free(fds);
+            free(fdConns);
+            return 5;
+        }
+        if (fds[0].revents){
+            char buf[64];
+            while (read(srv->wakePipe[0],buf,sizeof(buf))>0){}
+        }
+        for (i=1;i<1+(size_t)srv->nListen;++i){
+            if (fds[i].revents) sbpServerAccept(srv,fds[i].fd);
+        }
+        for (;i<nFds;++i){
+            if (!fds[i].revents) continue;
+            pthread_mutex_lock(&srv->lock);
+            fdConns[i]->armed=0;
+            pthread_mutex_unlock(&srv->lock);
+            sbpServerReady(srv,fdConns[i]);
+        }
+    }
+    free(fds);
+    free(fdConns);
+    return 0;
+}
+#endif
+
+int sbpServerRun(sbp_server *srv){
+    int i,err;
+    if (srv->config.nWorkers>0){
+        pthread_attr_t t_attr;
+        srv->workers=(pthread_t*)malloc(srv->config.nWorkers*sizeof(pthread_t));
+        if (!srv->workers) return 1;
+        pthread_attr_init(&t_attr);
+        pthread_attr_setstacksize(&t_attr,1024*1024);
+        for (i=0;i<srv->config.nWorkers;++i){
+            if (pthread_create(&srv->workers[i],&t_attr,&sbpServerWorker,srv)){
+                fprintf(stderr,"SBP server error creating worker thread\n");
+                break;
+            }
+            ++srv->nWorkersStarted;
+        }
+        pthread_attr_destroy(&t_attr);
+    }
+    err=sbpServerLoop(srv);
+    pthread_mutex_lock(&srv->lock);
+    srv->stop=1;
+    pthread_cond_broadcast(&srv->workAvailable);
+    pthread_mutex_unlock(&srv->lock);
+    for (i=0;i<srv->nWorkersStarted;++i){
+        pthread_join(srv->workers[i],NULL);
+    }
+    srv->nWorkersStarted=0;
+    free(srv->workers);
+    srv->workers=NULL;
+    srv->readyFirst=NULL;
+    srv->readyLast=NULL;
+    while (srv->conns){
+        sbpServerDropConn(srv,srv->conns);
+    }
+    return err;
+}
+
+int sbpServerStop(sbp_server *srv){
+    srv->stop=1;
+    sbpServerWake(srv);
+    return 0;
+}
+
+int sbpServerFree(sbp_server *srv){
+    if (!srv) return 0;
+    while (srv->conns){
+        sbpServerDropConn(srv,srv->conns);
+    }
+#ifdef SBP_USE_EPOLL
+    if (srv->epollFd>=0) close(srv->epollFd);
+#endif
+    close(srv->wakePipe[0]);
+    close(srv->wakePipe[1]);
+    pthread_mutex_destroy(&srv->lock);
+    pthread_cond_destroy(&srv->workAvailable);
+    free(srv);
+    return 0;
+}
+
+int sbpServe(socket_t listenSock,sbp_server_config *config){
+    sbp_server *srv;
+    int err=sbpServerCreate(&srv,listenSock,config);
+    if (err) return err;
+    err=sbpServerRun(srv);
+    sbpServerFree(srv);
+    return err;
+}
@@ -0,0 +1,655 @@
+/// shared memory transport for the simple binary protocol, and connection handshake
+/// when enabled (sbpShmEnable) connections between two processes on the same node
+/// negotiate, just after sbpConnectTo/sbpAccept, a shared segment with two ring
+/// buffers (one per direction). From then on the framing is unchanged, but all
+/// sbpSend*/sbpRead* on the socket copy directly between the user arrays and the rings,
+/// waiting with futexes (on linux) when a ring is full/empty. The socket is kept
+/// open, to detect the death of the peer and for sbpClose.
+///
+/// negotiation: if the shared memory transport or packed payloads are enabled the
+/// client sends a kind_handshake message with its capabilities (sbp_cap_*), followed,
+/// if it offers shared memory, by the cookie, the ring size and the name of a segment
+/// it created. The server answers with a kind_handshake message with the capabilities
+/// it accepted and sbp_cap_reply. Both sides have to enable the same features.
+/// sbpAccept waits only briefly for the handshake, a handshake arriving later is
+/// answered without capabilities by sbpReadHeader64. A client waits a bounded time for
+/// the answer and otherwise keeps the plain socket (a late answer is then dropped by
+/// sbpReadHeader64). If the server speaks first the client keeps the plain socket too.
+/// author: fawzi
+//
+// Copyright 2008-2010 the blip developer group
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// this file is explicitly released also with GPLv2 for the projects that might need it
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "SimpleProtocol.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#define SBP_USE_FUTEX 1
+#endif
+
+enum SBP_SHM_SIZES{
+    shm_default_ring=4194304,     // default bytes of each ring
+    shm_min_ring=65536,
+    shm_spin_iterations=4000,     // checks before sleeping on the futex
+    shm_wait_timeout_ms=100,      // futex sleeps are bounded to check the peer
+    shm_handshake_timeout_ms=5000,// time the client waits for the answer of the server
+    shm_accept_wait_ms=20,        // time sbpAccept waits for the client handshake
+    shm_max_name=64
+};
+
+#define SBP_SHM_MAGIC 0x3130306d68737062ULL // "bpshm001"
+
+// from SimpleProtocol.c
+extern int swapBits;
+void sbpEncodeHeader(char *bufPos, int32_t kind, uint64_t len);
+void sbpDecodeHeader(char *bufPos, uint32_t *kind, uint64_t *len);
+int sbpRecvAll(socket_t sock,void* start,uint64_t len);
+int sbpReadDirect(socket_t sock,void* start,uint64_t len);
+int sbpSendDirect(socket_t sock,void* start,uint64_t len);
+// from SimpleProtocolPack.c
+extern int sbpPackEnabled;
+void sbpPackSetPeer(socket_t sock,int packed);
+
+/// one direction of the transport, the data follows in the segment
+/// head/tail are absolute byte counts, the seq fields are the futex words
+struct sbp_shm_ring{
+    volatile uint64_t head;             // bytes written (changed only by the producer)
+    char pad0[56];
+    volatile uint64_t tail;             // bytes read (changed only by the consumer)
+    char pad1[56];
+    volatile uint32_t dataSeq;          // bumped when data is added and the consumer waits
+    volatile uint32_t consumerWaiting;
+    volatile uint32_t spaceSeq;         // bumped when data is consumed and the producer waits
+    volatile uint32_t producerWaiting;
+    volatile uint32_t closed;           // one of the two sides closed this direction
+    char pad2[44];
+};
+
+/// layout of the shared segment, ring 0 goes from client to server
+struct sbp_shm_segment{
+    uint64_t magic;
+    uint64_t cookie;
+    uint64_t ringSize;
+    char pad[40];
+    struct sbp_shm_ring rings[2];
+};
+
+/// the shared memory transport of a socket
+struct sbp_shm{
+    socket_t sock;
+    struct sbp_shm_segment *seg;
+    size_t mapLen;
+    uint64_t ringSize;
+    struct sbp_shm_ring *out,*in;
+    char *outData,*inData;
+};
+
+int sbpShmEnabled=0;
+uint64_t sbpShmRingSize=shm_default_ring;
+/// the transports of the sockets, indexed by socket, like the readers
+/// (size and entries in one block published atomically, old blocks are never freed)
+typedef struct sbp_shm_table{
+    size_t size;
+    sbp_shm *shms[];
+} sbp_shm_table;
+sbp_shm_table *sbpShms=NULL;
+pthread_mutex_t sbpShmsLock=PTHREAD_MUTEX_INITIALIZER;
+static uint32_t sbpShmCounter=0;
+static int sbpShmSpin=-1; // spinning is useless with a single cpu
+
+int sbpShmEnable(int enable,uint64_t ringSize){
+    uint64_t size=shm_min_ring;
+    if (ringSize==0) ringSize=shm_default_ring;
+    while (size<ringSize && size<((uint64_t)1<<40)) size*=2;
+    sbpShmRingSize=size;
+    sbpShmSpin=(sysconf(_SC_NPROCESSORS_ONLN)>1)?shm_spin_iterations:0;
+    sbpShmEnabled=(enable!=0);
+    return 0;
+}
+/// f77 interface
+void sbpshmenable(int*ierr,int*enable,uint64_t*ringSize){
+    *ierr=sbpShmEnable(*enable,*ringSize);
+}
+void sbpshmenable_(int*ierr,int*enable,uint64_t*ringSize){
+    *ierr=sbpShmEnable(*enable,*ringSize);
+}
+void sbpshmenable__(int*ierr,int*enable,uint64_t*ringSize){
+    *ierr=sbpShmEnable(*enable,*ringSize);
+}
+
+/// returns the shared memory transport of sock, or NULL
+sbp_shm *sbpShmFor(socket_t sock){
+    sbp_shm_table *table=__atomic_load_n(&sbpShms,__ATOMIC_ACQUIRE);
+    if (table && sock>=0 && (size_t)sock<table->size){
+        return __atomic_load_n(&table->shms[sock],__ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
+
+int sbpShmActive(socket_t sock){
+    return sbpShmFor(sock)!=NULL;
+}
+
+static int sbpShmRegister(sbp_shm *shm){
+    socket_t sock=shm->sock;
+    pthread_mutex_lock(&sbpShmsLock);
+    if (!sbpShms || (size_t)sock>=sbpShms->size){
+        size_t oldSize=(sbpShms)?sbpShms->size:0;
+        size_t newSize=(oldSize>0)?2*oldSize:64,i;
+        sbp_shm_table *newShms;
+        while (newSize<=(size_t)sock) newSize*=2;
+        newShms=(sbp_shm_table*)malloc(sizeof(sbp_shm_table)+newSize*sizeof(sbp_shm*));
+        if (!newShms){
+            pthread_mutex_unlock(&sbpShmsLock);
+            return 2;
+        }
+        newShms->size=newSize;
+        for (i=0;i<oldSize;++i) newShms->shms[i]=sbpShms->shms[i];
+        for (i=oldSize;i<newSize;++i) newShms->shms[i]=NULL;
+        __atomic_store_n(&sbpShms,newShms,__ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&sbpShms->shms[sock],shm,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sbpShmsLock);
+    return 0;
+}
+
+static inline void sbpCpuRelax(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void sbpShmFutexWait(volatile uint32_t *addr,uint32_t val,int timeoutMs){
+#ifdef SBP_USE_FUTEX
+    struct timespec ts;
+    ts.tv_sec=timeoutMs/1000;
+    ts.tv_nsec=(long)(timeoutMs%1000)*1000000L;
+    // shared mapping: no FUTEX_PRIVATE_FLAG
+    syscall(SYS_futex,(uint32_t*)addr,FUTEX_WAIT,val,&ts,NULL,0);
+#else
+    if (*addr==val) usleep(50);
+#endif
+}
+
+static void sbpShmFutexWake(volatile uint32_t *addr){
+#ifdef SBP_USE_FUTEX
+    syscall(SYS_futex,(uint32_t*)addr,FUTEX_WAKE,1,NULL,NULL,0);
+#endif
+}
+
+/// bytes available to read (forSpace=0) or to write (forSpace=1)
+static inline uint64_t sbpShmAvail(struct sbp_shm_ring *r,uint64_t ringSize,int forSpace){
+    uint64_t head=__atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+    uint64_t tail=__atomic_load_n(&r->tail,__ATOMIC_ACQUIRE);
+    return forSpace?ringSize-(head-tail):head-tail;
+}
+
+/// true if the other end of the socket is gone
+static int sbpShmPeerGone(sbp_shm *shm){
+    struct pollfd pfd;
+    char c;
+    pfd.fd=shm->sock;
+    pfd.events=POLLIN;
+#ifdef POLLRDHUP
+    pfd.events|=POLLRDHUP;
+#endif
+    pfd.revents=0;
+    if (poll(&pfd,1,0)<=0) return 0;
+    if (pfd.revents&(POLLHUP|POLLERR)) return 1;
+#ifdef POLLRDHUP
+    if (pfd.revents&POLLRDHUP) return 1;
+#endif
+    return (pfd.revents&POLLIN) && recv(shm->sock,&c,1,MSG_PEEK|MSG_DONTWAIT)==0;
+}
+
+/// waits until there is data (forSpace=0) or space (forSpace=1) in the ring
+/// returns non 0 if that will never happen
+static int sbpShmWait(sbp_shm *shm,struct sbp_shm_ring *r,int forSpace){
+    volatile uint32_t *seq=forSpace?&r->spaceSeq:&r->dataSeq;
+    volatile uint32_t *waiting=forSpace?&r->producerWaiting:&r->consumerWaiting;
+    int i;
+    for (i=0;i<sbpShmSpin;++i){
+        if (sbpShmAvail(r,shm->ringSize,forSpace)>0) return 0;
+        sbpCpuRelax();
+    }
+    while (1){
+        uint32_t s=__atomic_load_n(seq,__ATOMIC_ACQUIRE);
+        __atomic_store_n(waiting,1,__ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (sbpShmAvail(r,shm->ringSize,forSpace)>0){
+            __atomic_store_n(waiting,0,__ATOMIC_RELAXED);
+            return 0;
+        }
+        if (__atomic_load_n(&r->closed,__ATOMIC_ACQUIRE)){
+            __atomic_store_n(waiting,0,__ATOMIC_RELAXED);
+            return 1;
+        }
+        sbpShmFutexWait(seq,s,shm_wait_timeout_ms);
+        __atomic_store_n(waiting,0,__ATOMIC_RELAXED);
+        if (sbpShmAvail(r,shm->ringSize,forSpace)>0) return 0;
+        if (sbpShmPeerGone(shm)){
+            return sbpShmAvail(r,shm->ringSize,forSpace)==0;
+        }
+    }
+}
+
+/// publishes the new head/tail and wakes the other side if it sleeps
+static inline void sbpShmPublish(volatile uint64_t *pos,uint64_t newPos,
+    volatile uint32_t *waiting,volatile uint32_t *seq)
+{
+    __atomic_store_n(pos,newPos,__ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting,__ATOMIC_RELAXED)){
+        __atomic_add_fetch(seq,1,__ATOMIC_RELEASE);
+        sbpShmFutexWake(seq);
+    }
+}
+
+/// copies to the outgoing ring as much of src as fits (at most a quarter ring, so
+/// that the reader can start copying out at once), returns the bytes copied
+static size_t sbpShmWritePiece(sbp_shm *shm,const char *src,uint64_t len){
+    struct sbp_shm_ring *r=shm->out;
+    uint64_t avail=sbpShmAvail(r,shm->ringSize,1),head,off;
+    size_t n,first;
+    if (avail==0 || len==0) return 0;
+    n=(len<avail)?(size_t)len:(size_t)avail;
+    if (n>shm->ringSize/4) n=(size_t)(shm->ringSize/4);
+    head=r->head;
+    off=head&(shm->ringSize-1);
+    first=(off+n>shm->ringSize)?(size_t)(shm->ringSize-off):n;
+    memcpy(shm->outData+off,src,first);
+    if (first<n) memcpy(shm->outData,src+first,n-first);
+    sbpShmPublish(&r->head,head+n,&r->consumerWaiting,&r->dataSeq);
+    return n;
+}
+
+/// copies from the incoming ring to dst (or discards if dst is NULL) at most len
+/// bytes, returns the bytes consumed
+static size_t sbpShmReadPiece(sbp_shm *shm,char *dst,uint64_t len){
+    struct sbp_shm_ring *r=shm->in;
+    uint64_t avail=sbpShmAvail(r,shm->ringSize,0),tail,off;
+    size_t n,first;
+    if (avail==0 || len==0) return 0;
+    n=(len<avail)?(size_t)len:(size_t)avail;
+    if (n>shm->ringSize/4) n=(size_t)(shm->ringSize/4);
+    tail=r->tail;
+    off=tail&(shm->ringSize-1);
+    first=(off+n>shm->ringSize)?(size_t)(shm->ringSize-off):n;
+    if (dst){
+        memcpy(dst,shm->inData+off,first);
+        if (first<n) memcpy(dst+first,shm->inData,n-first);
+    }
+    sbpShmPublish(&r->tail,tail+n,&r->producerWaiting,&r->spaceSeq);
+    return n;
+}
+
+static int sbpShmWrite(sbp_shm *shm,const char *src,size_t len){
+    while (len>0){
+        size_t n=sbpShmWritePiece(shm,src,len);
+        if (n==0){
+            if (sbpShmWait(shm,shm->out,1)){
+                fprintf(stderr,"SBP shared memory peer closed while sending\n");
+                return 1;
+            }
+            continue;
+        }
+        src+=n;
+        len-=n;
+    }
+    return 0;
+}
+
+int sbpShmWriteV(sbp_shm *shm,struct iovec *iov,size_t iovcnt){
+    size_t i;
+    for (i=0;i<iovcnt;++i){
+        if (sbpShmWrite(shm,(const char*)iov[i].iov_base,iov[i].iov_len)) return 1;
+    }
+    return 0;
+}
+
+/// reads len bytes from the incoming ring to dst (or discards them if dst is NULL)
+int sbpShmRead(sbp_shm *shm,void *dst,uint64_t len){
+    char *pos=(char*)dst;
+    while (len>0){
+        size_t n=sbpShmReadPiece(shm,pos,len);
+        if (n==0){
+            if (sbpShmWait(shm,shm->in,0)){
+                fprintf(stderr,"SBP EOF reading from shared memory\n");
+                return 5;
+            }
+            continue;
+        }
+        if (pos) pos+=n;
+        len-=n;
+    }
+    return 0;
+}
+
+/// non blocking write: returns the bytes written, -1 if the peer is gone
+int64_t sbpShmTryWrite(sbp_shm *shm,const char *src,uint64_t len){
+    uint64_t done=0;
+    size_t n;
+    while (done<len && (n=sbpShmWritePiece(shm,src+done,len-done))>0) done+=n;
+    if (done==0 && len>0 && (__atomic_load_n(&shm->out->closed,__ATOMIC_ACQUIRE)
+        || sbpShmPeerGone(shm))) return -1;
+    return (int64_t)done;
+}
+
+/// non blocking read (dst NULL discards): returns the bytes read, -1 at EOF
+int64_t sbpShmTryRead(sbp_shm *shm,char *dst,uint64_t len){
+    uint64_t done=0;
+    size_t n;
+    while (done<len && (n=sbpShmReadPiece(shm,dst?dst+done:NULL,len-done))>0) done+=n;
+    if (done==0 && len>0 && sbpShmAvail(shm->in,shm->ringSize,0)==0
+        && (__atomic_load_n(&shm->in->closed,__ATOMIC_ACQUIRE) || sbpShmPeerGone(shm))) return -1;
+    return (int64_t)done;
+}
+
+/// marks the outgoing (what=1), incoming (what=0) or both directions as closed, and
+/// with both also unmaps the segment and forgets the transport of sock
+int sbpShmClose(socket_t sock,int what){
+    sbp_shm *shm=sbpShmFor(sock);
+    if (!shm) return 0;
+    if (what!=0){
+        __atomic_store_n(&shm->out->closed,1,__ATOMIC_RELEASE);
+        __atomic_add_fetch(&shm->out->dataSeq,1,__ATOMIC_RELEASE);
+        sbpShmFutexWake(&shm->out->dataSeq);
+    }
+    if (what!=1){
+        __atomic_store_n(&shm->in->closed,1,__ATOMIC_RELEASE);
+        __atomic_add_fetch(&shm->in->spaceSeq,1,__ATOMIC_RELEASE);
+        sbpShmFutexWake(&shm->in->spaceSeq);
+    }
+    if (what==2){
+        pthread_mutex_lock(&sbpShmsLock);
+        __atomic_store_n(&sbpShms->shms[sock],NULL,__ATOMIC_RELEASE);
+        pthread_mutex_unlock(&sbpShmsLock);
+        munmap(shm->seg,shm->mapLen);
+        free(shm);
+    }
+    return 0;
+}
+
+//////// negotiation ////////
+
+/// true if the peer of sock is on this node (loopback, or same address as ours)
+static int sbpShmPeerIsLocal(socket_t sock){
+    struct sockaddr_storage peer,self;
+    socklen_t peerLen=sizeof(peer),selfLen=sizeof(self);
+    if (getpeername(sock,(struct sockaddr*)&peer,&peerLen)!=0) return 0;
+    if (getsockname(sock,(struct sockaddr*)&self,&selfLen)!=0) return 0;
+    if (peer.ss_family==AF_UNIX) return 1;
+    if (peer.ss_family!=self.ss_family) return 0;
+    if (peer.ss_family==AF_INET){
+        struct sockaddr_in *p=(struct sockaddr_in*)&peer,*s=(struct sockaddr_in*)&self;
+        if ((ntohl(p->sin_addr.s_addr)>>24)==127) return 1;
+        return p->sin_addr.s_addr==s->sin_addr.s_addr;
+    }
+    if (peer.ss_family==AF_INET6){
+        struct sockaddr_in6 *p=(struct sockaddr_in6*)&peer,*s=(struct sockaddr_in6*)&self;
+        if (IN6_IS_ADDR_LOOPBACK(&p->sin6_addr)) return 1;
+        if (IN6_IS_ADDR_V4MAPPED(&p->sin6_addr) && p->sin6_addr.s6_addr[12]==127) return 1;
+        return memcmp(&p->sin6_addr,&s->sin6_addr,sizeof(p->sin6_addr))==0;
+    }
+    return 0;
+}
+
+/// maps the segment in fd, checking (if cookie!=0) that it is the expected one
+static sbp_shm *sbpShmMap(socket_t sock,int fd,uint64_t ringSize,uint64_t cookie,int isServer){
+    size_t mapLen=sizeof(struct sbp_shm_segment)+2*(size_t)ringSize;
+    struct stat st;
+    sbp_shm *shm;
+    void *mem;
+    if (fstat(fd,&st)!=0 || (size_t)st.st_size!=mapLen) return NULL;
+    mem=mmap(NULL,mapLen,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if (mem==MAP_FAILED){
+        perror("SBP mapping shared memory segment");
+        return NULL;
+    }
+    shm=(sbp_shm*)malloc(sizeof(sbp_shm));
+    if (!shm){
+        munmap(mem,mapLen);
+        return NULL;
+    }
+    shm->sock=sock;
+    shm->seg=(struct sbp_shm_segment*)mem;
+    shm->mapLen=mapLen;
+    shm->ringSize=ringSize;
+    if (cookie!=0 && (shm->seg->magic!=SBP_SHM_MAGIC || shm->seg->cookie!=cookie
+        || shm->seg->ringSize!=ringSize))
+    {
+        munmap(mem,mapLen);
+        free(shm);
+        return NULL;
+    }
+    shm->out=&shm->seg->rings[isServer?1:0];
+    shm->in=&shm->seg->rings[isServer?0:1];
+    shm->outData=(char*)mem+sizeof(struct sbp_shm_segment)+(isServer?ringSize:0);
+    shm->inData=(char*)mem+sizeof(struct sbp_shm_segment)+(isServer?0:ringSize);
+    return shm;
+}
+
+/// 8 byte values of the handshake are small endian, like the header
+static void sbpShmPut64(char *p,uint64_t v){
+    int i;
+    for (i=0;i<8;++i) p[i]=(char)(v>>(8*i));
+}
+
+static uint64_t sbpShmGet64(const char *p){
+    uint64_t v=0;
+    int i;
+    for (i=0;i<8;++i) v|=((uint64_t)(unsigned char)p[i])<<(8*i);
+    return v;
+}
+
+static uint64_t sbpShmNewCookie(void){
+    struct timeval tv;
+    uint64_t c;
+    gettimeofday(&tv,NULL);
+    c=((uint64_t)tv.tv_sec<<20)^(uint64_t)tv.tv_usec^((uint64_t)getpid()<<32)
+        ^((uint64_t)__atomic_add_fetch(&sbpShmCounter,1,__ATOMIC_RELAXED)<<48);
+    return c|1;
+}
+
+/// waits at most timeoutMs for a message header on the socket and peeks it in msg
+/// returns 0 if the header is there, 1 on errors or if the connection was closed,
+/// 2 if it did not arrive in time
+static int sbpHandshakePeek(socket_t sock,char *msg,int timeoutMs){
+    struct timeval start,now;
+    gettimeofday(&start,NULL);
+    while (1){
+        struct pollfd pfd;
+        ssize_t peeked;
+        int waited;
+        peeked=recv(sock,msg,12,MSG_PEEK|MSG_DONTWAIT);
+        if (peeked==12) return 0;
+        if (peeked==0) return 1;
+        if (peeked<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR) return 1;
+        gettimeofday(&now,NULL);
+        waited=(int)((now.tv_sec-start.tv_sec)*1000+(now.tv_usec-start.tv_usec)/1000);
+        if (waited>=timeoutMs) return 2;
+        pfd.fd=sock;
+        pfd.events=POLLIN;
+        pfd.revents=0;
+        // with a partial header poll returns at once, so sleep a bit
+        if (peeked>0){
+            usleep(1000);
+        } else if (poll(&pfd,1,timeoutMs-waited)<0 && errno!=EINTR){
+            return 1;
+        }
+    }
+}
+
+/// client side of the negotiation, called by sbpConnectTo32 on new connections
+/// a failure just leaves the connection on the socket
+int sbpHandshakeConnect(socket_t sock){
+    char msg[12+24+shm_max_name];
+    char name[shm_max_name];
+    uint64_t cookie=0,ringSize=sbpShmRingSize,len,caps=0;
+    uint32_t kind;
+    sbp_shm *shm=NULL;
+    size_t nameLen=0;
+    int fd=-1,err;
+    if (!sbpShmEnabled && !sbpPackEnabled) return 0;
+    if (sbpPackEnabled) caps|=sbp_cap_packed;
+    if (sbpShmEnabled && sbpShmPeerIsLocal(sock)){
+        cookie=sbpShmNewCookie();
+        snprintf(name,sizeof(name),"/sbp-%ld-%u-%08x",(long)getpid(),
+            (unsigned)__atomic_add_fetch(&sbpShmCounter,1,__ATOMIC_RELAXED),(unsigned)cookie);
+        nameLen=strlen(name);
+        fd=shm_open(name,O_CREAT|O_EXCL|O_RDWR,0600);
+        if (fd>=0){
+            if (ftruncate(fd,(off_t)(sizeof(struct sbp_shm_segment)+2*ringSize))==0){
+                shm=sbpShmMap(sock,fd,ringSize,0,0);
+            }
+            close(fd);
+        }
+        if (shm){
+            memset(shm->seg,0,sizeof(struct sbp_shm_segment));
+            shm->seg->cookie=cookie;
+            shm->seg->ringSize=ringSize;
+            __atomic_store_n(&shm->seg->magic,SBP_SHM_MAGIC,__ATOMIC_RELEASE);
+            caps|=sbp_cap_shm;
+        } else {
+            if (fd>=0) shm_unlink(name);
+            nameLen=0;
+        }
+    }
+    len=(nameLen>0)?24+nameLen:8;
+    sbpEncodeHeader(msg,kind_handshake,len);
+    sbpShmPut64(msg+12,caps);
+    sbpShmPut64(msg+20,cookie);
+    sbpShmPut64(msg+28,ringSize);
+    memcpy(msg+36,name,nameLen);
+    err=sbpSendDirect(sock,msg,12+len);
+    if (err==0) err=sbpHandshakePeek(sock,msg,shm_handshake_timeout_ms);
+    caps=0;
+    if (err==0){
+        sbpDecodeHeader(msg,&kind,&len);
+        // a server speaking first did not understand the handshake, leave its data
+        if (kind==kind_handshake && len==8){
+            err=sbpRecvAll(sock,msg,20);
+            if (err==0) caps=sbpShmGet64(msg+12);
+        }
+    } else if (err==2){
+        fprintf(stderr,"SBP no answer to the connection handshake, using the plain socket\n");
+        err=0;
+    }
+    if (nameLen>0) shm_unlink(name); // the server has it mapped (or never will)
+    if (err){
+        fprintf(stderr,"SBP connection handshake failed\n");
+        caps=0;
+    }
+    sbpPackSetPeer(sock,(caps&sbp_cap_packed)!=0);
+    if (shm && ((caps&sbp_cap_shm)==0 || sbpShmRegister(shm)!=0)){
+        munmap(shm->seg,shm->mapLen);
+        free(shm);
+    }
+    return err;
+}
+
+/// server side of the negotiation, called by sbpAccept32 on new connections
+/// if the client does not start with a handshake its data is left untouched
+/// the handshake is waited for at most shm_accept_wait_ms, so that clients expecting the
+/// server to speak first are not stalled, later handshakes get sbpHandshakeLate
+int sbpHandshakeAccept(socket_t sock){
+    char msg[12+24+shm_max_name];
+    char name[shm_max_name+1];
+    uint32_t kind;
+    uint64_t len,cookie,ringSize,caps,accepted=sbp_cap_reply;
+    sbp_shm *shm=NULL;
+    if (!sbpShmEnabled && !sbpPackEnabled) return 0;
+    // closed connections and errors are reported by the next read
+    if (sbpHandshakePeek(sock,msg,shm_accept_wait_ms)!=0) return 0;
+    sbpDecodeHeader(msg,&kind,&len);
+    if (kind!=kind_handshake) return 0; // not a handshake, keep it for the user
+    if (sbpRecvAll(sock,msg,12)!=0) return 1;
+    if (len<8 || len>24+shm_max_name){
+        if (sbpSkip(sock,len)!=0) return 1;
+        len=0;
+    } else if (sbpRecvAll(sock,msg+12,len)!=0){
+        return 1;
+    }
+    caps=(len>=8)?sbpShmGet64(msg+12):0;
+    if (caps&sbp_cap_reply) return 0; // not for us, the reader drops it
+    if ((caps&sbp_cap_packed) && sbpPackEnabled) accepted|=sbp_cap_packed;
+    if ((caps&sbp_cap_shm) && len>24 && sbpShmEnabled && sbpShmPeerIsLocal(sock)){
+        int fd;
+        cookie=sbpShmGet64(msg+20);
+        ringSize=sbpShmGet64(msg+28);
+        memcpy(name,msg+36,len-24);
+        name[len-24]=0;
+        fd=(ringSize>=shm_min_ring && (ringSize&(ringSize-1))==0)?shm_open(name,O_RDWR,0600):-1;
+        if (fd>=0){
+            shm=sbpShmMap(sock,fd,ringSize,cookie,1);
+            close(fd);
+        }
+        if (shm) accepted|=sbp_cap_shm;
+    }
+    sbpEncodeHeader(msg,kind_handshake,8);
+    sbpShmPut64(msg+12,accepted);
+    if (sbpSendDirect(sock,msg,20)!=0){
+        if (shm){
+            munmap(shm->seg,shm->mapLen);
+            free(shm);
+        }
+        return 1;
+    }
+    sbpPackSetPeer(sock,(accepted&sbp_cap_packed)!=0);
+    if (shm && sbpShmRegister(shm)!=0){
+        munmap(shm->seg,shm->mapLen);
+        free(shm);
+        return 2;
+    }
+    return 0;
+}
+
+/// answers (without capabilities) a handshake that arrived after sbpAccept gave up
+/// waiting for it, and drops late answers to our own handshake. Called by
+/// sbpReadHeader64 after reading a kind_handshake header.
+int sbpHandshakeLate(socket_t sock,uint64_t len){
+    char msg[20];
+    uint64_t caps=0;
+    int err;
+    if (len>=8){
+        if ((err=sbpReadDirect(sock,msg,8))!=0) return err;
+        caps=sbpShmGet64(msg);
+        len-=8;
+    }
+    if (len>0 && (err=sbpSkip(sock,len))!=0) return err;
+    if (caps&sbp_cap_reply) return 0;
+    sbpEncodeHeader(msg,kind_handshake,8);
+    sbpShmPut64(msg+12,sbp_cap_reply);
+    return sbpSendDirect(sock,msg,20);
+}
@@ -0,0 +1,473 @@
+/// zero copy transfers for the simple binary protocol
+/// payloads can be sent directly from a file (sendfile) and received directly
+/// into a file (splice), and large arrays can be sent with MSG_ZEROCOPY, in which case
+/// the caller has to wait for the completion of the send before reusing the array.
+/// Where these system calls are not available (or fail) plain reads/writes are used.
+/// File payloads are transferred as they are, so they should already be in the
+/// protocol (small endian) byte order.
+/// author: fawzi
+//
+// Copyright 2008-2010 the blip developer group
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// this file is explicitly released also with GPLv2 for the projects that might need it
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "SimpleProtocol.h"
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#define SBP_USE_SENDFILE 1
+#define SBP_USE_SPLICE 1
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#define SBP_USE_MSG_ZEROCOPY 1
+#endif
+
+enum SBP_ZC_SIZES{
+    fd_copy_buf_size=65536,     // buffer of the read/write fallbacks
+    splice_chunk=1048576,       // maximum bytes moved by a single splice
+    zc_send_chunk=4194304       // maximum bytes of a single zero copy send
+};
+
+// from SimpleProtocol.c
+extern int swapBits;
+int sbpSendDirect(socket_t sock,void* start,uint64_t len);
+int sbpReadDirect(socket_t sock,void* start,uint64_t len);
+uint64_t sbpReaderConsume(socket_t sock,char **data,uint64_t maxLen);
+// from SimpleProtocolShm.c
+sbp_shm *sbpShmFor(socket_t sock);
+
+struct sbp_zerocopy{
+    socket_t sock;
+    int enabled;            // MSG_ZEROCOPY accepted by the socket
+    uint32_t nextId;        // id the kernel will give to the next zero copy send
+    uint32_t completed;     // all sends with id < completed are done
+};
+
+static int sbpWaitFd(int fd,short events){
+    struct pollfd pfd;
+    pfd.fd=fd;
+    pfd.events=events;
+    pfd.revents=0;
+    if (poll(&pfd,1,-1)<0 && errno!=EINTR){
+        perror("SBP error in poll");
+        return 1;
+    }
+    return 0;
+}
+
+/// sends with pread/write, used when sendfile is not available
+static int sbpSendFdCopy(socket_t sock,int fd,uint64_t offset,uint64_t len){
+    char *buf=(char*)malloc(fd_copy_buf_size);
+    if (!buf) return 1;
+    while (len>0){
+        size_t toRead=(len>fd_copy_buf_size)?fd_copy_buf_size:(size_t)len;
+        ssize_t readB=pread(fd,buf,toRead,(off_t)offset);
+        if (readB<0 && errno==EINTR) continue;
+        if (readB<=0){
+            perror("SBP error reading the file to send");
+            free(buf);
+            return 2;
+        }
+        if (sbpSendDirect(sock,buf,(uint64_t)readB)!=0){
+            free(buf);
+            return 3;
+        }
+        offset+=(uint64_t)readB;
+        len-=(uint64_t)readB;
+    }
+    free(buf);
+    return 0;
+}
+
+int sbpSendFdPiece64(socket_t sock,int fd,uint64_t offset,uint64_t len){
+#ifdef SBP_USE_SENDFILE
+    off_t off=(off_t)offset;
+    if (sbpShmFor(sock)) return sbpSendFdCopy(sock,fd,offset,len);
+    while (len>0){
+        ssize_t sent=sendfile(sock,fd,&off,(size_t)((len>0x7ffff000UL)?0x7ffff000UL:len));
+        if (sent<0){
+            if (errno==EINTR) continue;
+            if (errno==EAGAIN){
+                if (sbpWaitFd(sock,POLLOUT)) return 2;
+                continue;
+            }
+            if (errno==EINVAL || errno==ENOSYS){
+                return sbpSendFdCopy(sock,fd,(uint64_t)off,len);
+            }
+            perror("SBP error in sendfile");
+            return 1;
+        }
+        if (sent==0){
+            fprintf(stderr,"SBP file ended before the data to send\n");
+            return 3;
+        }
+        len-=(uint64_t)sent;
+    }
+    return 0;
+#else
+    return sbpSendFdCopy(sock,fd,offset,len);
+#endif
+}
+/// f77 interface
+void sbpsendfdp64(int*ierr,socket_t*sock,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpSendFdPiece64(*sock,*fd,*offset,*len);
+}
+void sbpsendfdp64_(int*ierr,socket_t*sock,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpSendFdPiece64(*sock,*fd,*offset,*len);
+}
+void sbpsendfdp64__(int*ierr,socket_t*sock,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpSendFdPiece64(*sock,*fd,*offset,*len);
+}
+
+int sbpSendFd64(socket_t sock,int32_t kind,int fd,uint64_t offset,uint64_t len){
+    if (sbpSendHeader64(sock,kind,len)!=0) return 3;
+    return sbpSendFdPiece64(sock,fd,offset,len);
+}
+/// f77 interface
+void sbpsendfd64(int*ierr,socket_t*sock,int32_t*kind,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpSendFd64(*sock,*kind,*fd,*offset,*len);
+}
+void sbpsendfd64_(int*ierr,socket_t*sock,int32_t*kind,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpSendFd64(*sock,*kind,*fd,*offset,*len);
+}
+void sbpsendfd64__(int*ierr,socket_t*sock,int32_t*kind,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpSendFd64(*sock,*kind,*fd,*offset,*len);
+}
+
+/// writes all the data to the file at the given offset
+static int sbpPwriteAll(int fd,char *data,uint64_t len,uint64_t offset){
+    while (len>0){
+        ssize_t written=pwrite(fd,data,(size_t)len,(off_t)offset);
+        if (written<0 && errno==EINTR) continue;
+        if (written<=0){
+            perror("SBP error writing received data to file");
+            return 1;
+        }
+        data+=written;
+        offset+=(uint64_t)written;
+        len-=(uint64_t)written;
+    }
+    return 0;
+}
+
+/// receives with read/pwrite, used when splice is not available
+static int sbpReadToFdCopy(socket_t sock,int fd,uint64_t offset,uint64_t len){
+    char *buf=(char*)malloc(fd_copy_buf_size);
+    if (!buf) return 1;
+    while (len>0){
+        size_t toRead=(len>fd_copy_buf_size)?fd_copy_buf_size:(size_t)len;
+        if (sbpReadDirect(sock,buf,toRead)!=0 || sbpPwriteAll(fd,buf,toRead,offset)!=0){
+            free(buf);
+            return 2;
+        }
+        offset+=toRead;
+        len-=toRead;
+    }
+    free(buf);
+    return 0;
+}
+
+int sbpReadToFdPiece64(socket_t sock,int fd,uint64_t offset,uint64_t len){
+    char *buffered;
+    uint64_t n;
+    // data already in the buffer of a reader
+    while (len>0 && (n=sbpReaderConsume(sock,&buffered,len))>0){
+        if (sbpPwriteAll(fd,buffered,n,offset)!=0) return 4;
+        offset+=n;
+        len-=n;
+    }
+    if (len==0) return 0;
+    if (sbpShmFor(sock)) return sbpReadToFdCopy(sock,fd,offset,len);
+#ifdef SBP_USE_SPLICE
+    {
+        int pipeFd[2];
+        loff_t off=(loff_t)offset;
+        if (pipe(pipeFd)!=0){
+            return sbpReadToFdCopy(sock,fd,offset,len);
+        }
+        while (len>0){
+            size_t chunk=(len>splice_chunk)?splice_chunk:(size_t)len;
+            ssize_t inPipe=splice(sock,NULL,pipeFd[1],NULL,chunk,SPLICE_F_MOVE|SPLICE_F_MORE);
+            if (inPipe<0){
+                if (errno==EINTR) continue;
+                if (errno==EAGAIN){
+                    if (sbpWaitFd(sock,POLLIN)) break;
+                    continue;
+                }
+                if (errno==EINVAL || errno==ENOSYS){
+                    close(pipeFd[0]);
+                    close(pipeFd[1]);
+                    return sbpReadToFdCopy(sock,fd,(uint64_t)off,len);
+                }
+                perror("SBP error in splice from socket");
+                break;
+            }
+            if (inPipe==0){
+                fprintf(stderr,"SBP EOF while splicing to file\n");
+                break;
+            }
+            len-=(uint64_t)inPipe;
+            while (inPipe>0){
+                ssize_t out=splice(pipeFd[0],NULL,fd,&off,(size_t)inPipe,SPLICE_F_MOVE|SPLICE_F_MORE);
+                if (out<0 && errno==EINTR) continue;
+                if (out<=0){
+                    perror("SBP error in splice to file");
+                    close(pipeFd[0]);
+                    close(pipeFd[1]);
+                    return 5;
+                }
+                inPipe-=out;
+            }
+        }
+        close(pipeFd[0]);
+        close(pipeFd[1]);
+        return (len==0)?0:6;
+    }
+#else
+    return sbpReadToFdCopy(sock,fd,offset,len);
+#endif
+}
+/// f77 interface
+void sbpreadfdp64(int*ierr,socket_t*sock,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpReadToFdPiece64(*sock,*fd,*offset,*len);
+}
+void sbpreadfdp64_(int*ierr,socket_t*sock,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpReadToFdPiece64(*sock,*fd,*offset,*len);
+}
+void sbpreadfdp64__(int*ierr,socket_t*sock,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpReadToFdPiece64(*sock,*fd,*offset,*len);
+}
+
+int sbpReadToFd64(socket_t sock,uint32_t *kind,int fd,uint64_t offset,uint64_t *len){
+    if (sbpReadHeader64(sock,kind,len)!=0) return 13;
+    return sbpReadToFdPiece64(sock,fd,offset,*len);
+}
+/// f77 interface
+void sbpreadfd64(int*ierr,socket_t*sock,uint32_t*kind,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpReadToFd64(*sock,kind,*fd,*offset,len);
+}
+void sbpreadfd64_(int*ierr,socket_t*sock,uint32_t*kind,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpReadToFd64(*sock,kind,*fd,*offset,len);
+}
+void sbpreadfd64__(int*ierr,socket_t*sock,uint32_t*kind,int*fd,uint64_t*offset,uint64_t*len){
+    *ierr=sbpReadToFd64(*sock,kind,*fd,*offset,len);
+}
+
+//////// MSG_ZEROCOPY ////////
+
+int sbpZeroCopyInit(sbp_zerocopy **zc,socket_t sock){
+    sbp_zerocopy *z=(sbp_zerocopy*)calloc(1,sizeof(sbp_zerocopy));
+    *zc=NULL;
+    if (!z) return 1;
+    z->sock=sock;
+#ifdef SBP_USE_MSG_ZEROCOPY
+    {
+        int one=1;
+        z->enabled=(!swapBits && !sbpShmFor(sock) && setsockopt(sock,SOL_SOCKET,SO_ZEROCOPY,&one,sizeof(one))==0);
+    }
+#endif
+    *zc=z;
+    return 0;
+}
+/// f77 interface
+void sbpzcinit(int*ierr,sbp_zerocopy**zc,socket_t*sock){
+    *ierr=sbpZeroCopyInit(zc,*sock);
+}
+void sbpzcinit_(int*ierr,sbp_zerocopy**zc,socket_t*sock){
+    *ierr=sbpZeroCopyInit(zc,*sock);
+}
+void sbpzcinit__(int*ierr,sbp_zerocopy**zc,socket_t*sock){
+    *ierr=sbpZeroCopyInit(zc,*sock);
+}
+
+int sbpZeroCopyFree(sbp_zerocopy *zc){
+    free(zc);
+    return 0;
+}
+/// f77 interface
+void sbpzcfree(int*ierr,sbp_zerocopy**zc){
+    *ierr=sbpZeroCopyFree(*zc);
+    *zc=NULL;
+}
+void sbpzcfree_(int*ierr,sbp_zerocopy**zc){
+    sbpzcfree(ierr,zc);
+}
+void sbpzcfree__(int*ierr,sbp_zerocopy**zc){
+    sbpzcfree(ierr,zc);
+}
+
+int sbpZeroCopyEnabled(sbp_zerocopy *zc){
+    return zc->enabled;
+}
+
+#ifdef SBP_USE_MSG_ZEROCOPY
+/// reads the completion notifications from the socket error queue
+static int sbpZeroCopyReap(sbp_zerocopy *zc){
+    while (1){
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+        memset(&msg,0,sizeof(msg));
+        msg.msg_control=control;
+        msg.msg_controllen=sizeof(control);
+        if (recvmsg(zc->sock,&msg,MSG_ERRQUEUE|MSG_DONTWAIT)<0){
+            if (errno==EINTR) continue;
+            if (errno==EAGAIN || errno==EWOULDBLOCK) return 0;
+            perror("SBP error reading zero copy completions");
+            return 1;
+        }
+        for (cm=CMSG_FIRSTHDR(&msg);cm;cm=CMSG_NXTHDR(&msg,cm)){
+            struct sock_extended_err *serr=(struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno!=0 || serr->ee_origin!=SO_EE_ORIGIN_ZEROCOPY) continue;
+            // [ee_info,ee_data] is a range of completed sends, completions arrive in order
+            if ((int32_t)(serr->ee_data+1-zc->completed)>0){
+                zc->completed=serr->ee_data+1;
+            }
+        }
+    }
+}
+#endif
+
+int sbpZeroCopyPiece64(sbp_zerocopy *zc,void *p,uint64_t len,uint32_t *ticket){
+    char *pos=(char*)p;
+    *ticket=zc->nextId;
+    if (!zc->enabled) return sbpSendDirect(zc->sock,p,len);
+#ifdef SBP_USE_MSG_ZEROCOPY
+    while (len>0){
+        size_t toSend=(len>zc_send_chunk)?zc_send_chunk:(size_t)len;
+        ssize_t sent=send(zc->sock,pos,toSend,MSG_ZEROCOPY);
+        if (sent<0){
+            if (errno==EINTR) continue;
+            if (errno==EAGAIN){
+                if (sbpWaitFd(zc->sock,POLLOUT)) return 2;
+                continue;
+            }
+            if (errno==ENOBUFS){
+                // too much pinned memory, wait for completions
+                sbpZeroCopyReap(zc);
+                if (sbpWaitFd(zc->sock,POLLOUT)) return 2;
+                continue;
+            }
+            perror("SBP error in zero copy send");
+            return 1;
+        }
+        *ticket=zc->nextId;
+        ++zc->nextId;
+        pos+=sent;
+        len-=(uint64_t)sent;
+    }
+    return 0;
+#else
+    return sbpSendDirect(zc->sock,p,len);
+#endif
+}
+
+/// common implementation of the sends with header
+static int sbpZeroCopySendKind(sbp_zerocopy *zc,int32_t kind,void *p,uint64_t byteLen,int elSize,uint32_t *ticket){
+    if (sbpSendHeader64(zc->sock,kind,byteLen)!=0) return 3;
+    if (swapBits){
+        int err;
+        *ticket=zc->nextId; // swapped data is sent from a copy, the buffer is free at once
+        if (elSize==4){
+            err=sbpSend4_64(zc->sock,p,byteLen);
+        } else if (elSize==8){
+            err=sbpSend8_64(zc->sock,p,byteLen);
+        } else {
+            err=sbpSendDirect(zc->sock,p,byteLen);
+        }
+        return err;
+    }
+    return sbpZeroCopyPiece64(zc,p,byteLen,ticket);
+}
+
+int sbpZeroCopyChars64(sbp_zerocopy *zc,char *p,uint64_t len,uint32_t *ticket){
+    return sbpZeroCopySendKind(zc,kind_char,p,len,1,ticket);
+}
+
+int sbpZeroCopyInt4Array64(sbp_zerocopy *zc,void *p,uint64_t len,uint32_t *ticket){
+    return sbpZeroCopySendKind(zc,kind_int_small,p,4UL*len,4,ticket);
+}
+/// f77 interface
+void sbpzcsendi64(int*ierr,sbp_zerocopy**zc,void*p,uint64_t*len,uint32_t*ticket){
+    *ierr=sbpZeroCopyInt4Array64(*zc,p,*len,ticket);
+}
+void sbpzcsendi64_(int*ierr,sbp_zerocopy**zc,void*p,uint64_t*len,uint32_t*ticket){
+    *ierr=sbpZeroCopyInt4Array64(*zc,p,*len,ticket);
+}
+void sbpzcsendi64__(int*ierr,sbp_zerocopy**zc,void*p,uint64_t*len,uint32_t*ticket){
+    *ierr=sbpZeroCopyInt4Array64(*zc,p,*len,ticket);
+}
+
+int sbpZeroCopyDoubleArray64(sbp_zerocopy *zc,void *p,uint64_t len,uint32_t *ticket){
+    return sbpZeroCopySendKind(zc,kind_double_small,p,8UL*len,8,ticket);
+}
+/// f77 interface
+void sbpzcsendd64(int*ierr,sbp_zerocopy**zc,void*p,uint64_t*len,uint32_t*ticket){
+    *ierr=sbpZeroCopyDoubleArray64(*zc,p,*len,ticket);
+}
+void sbpzcsendd64_(int*ierr,sbp_zerocopy**zc,void*p,uint64_t*len,uint32_t*ticket){
+    *ierr=sbpZeroCopyDoubleArray64(*zc,p,*len,ticket);
+}
+void sbpzcsendd64__(int*ierr,sbp_zerocopy**zc,void*p,uint64_t*len,uint32_t*ticket){
+    *ierr=sbpZeroCopyDoubleArray64(*zc,p,*len,ticket);
+}
+
+int sbpZeroCopyDone(sbp_zerocopy *zc,uint32_t ticket){
+#ifdef SBP_USE_MSG_ZEROCOPY
+    if (!zc->enabled || (int32_t)(ticket-zc->nextId)>=0) return 1; // nothing pending
+    if ((int32_t)(ticket-zc->completed)<0) return 1;
+    sbpZeroCopyReap(zc);
+    return (int32_t)(ticket-zc->completed)<0;
+#else
+    return 1;
+#endif
+}
+
+int sbpZeroCopyWait(sbp_zerocopy *zc,uint32_t ticket){
+    while (!sbpZeroCopyDone(zc,ticket)){
+        // completions are signaled as POLLERR
+        if (sbpWaitFd(zc->sock,0)) return 1;
+    }
+    return 0;
+}
+/// f77 interface
+void sbpzcwait(int*ierr,sbp_zerocopy**zc,uint32_t*ticket){
+    *ierr=sbpZeroCopyWait(*zc,*ticket);
+}
+void sbpzcwait_(int*ierr,sbp_zerocopy**zc,uint32_t*ticket){
+    *ierr=sbpZeroCopyWait(*zc,*ticket);
+}
+void sbpzcwait__(int*ierr,sbp_zerocopy**zc,uint32_t*ticket){
+    *ierr=sbpZeroCopyWait(*zc,*ticket);
+}
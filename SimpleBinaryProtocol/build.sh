@@ -3,8 +3,13 @@
 if [ -z "$CC" ]; then
     CC=gcc
 fi
+# the library is optimized too, SbpBench measures its performance
+if [ -z "$CFLAGS" ]; then
+    CFLAGS="-g -O2"
+fi
 
-$CC -g -c SimpleProtocol.c
-ar -r libSimpleProtocol.a SimpleProtocol.o
-$CC -g -o EchoServer EchoServer.c SimpleProtocol.c -lpthread
-$CC -g -o SimpleClient SimpleClient.c SimpleProtocol.c
+$CC $CFLAGS -c SimpleProtocol.c SimpleProtocolServer.c SimpleProtocolZeroCopy.c SimpleProtocolShm.c SimpleProtocolAsync.c SimpleProtocolPack.c SimpleProtocolMux.c
+ar -r libSimpleProtocol.a SimpleProtocol.o SimpleProtocolServer.o SimpleProtocolZeroCopy.o SimpleProtocolShm.o SimpleProtocolAsync.o SimpleProtocolPack.o SimpleProtocolMux.o
+$CC $CFLAGS -o EchoServer EchoServer.c libSimpleProtocol.a -lpthread
+$CC $CFLAGS -o SimpleClient SimpleClient.c libSimpleProtocol.a -lpthread
+$CC $CFLAGS -o SbpBench SbpBench.c libSimpleProtocol.a -lpthread -lm
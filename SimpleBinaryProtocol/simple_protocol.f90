@@ -65,7 +65,7 @@ INTERFACE
 END INTERFACE
 
 INTERFACE sbpsendh
-   MODULE PROCEDURE sbpsendh64, sbpsendh32
+   PROCEDURE :: sbpsendh64, sbpsendh32
 END INTERFACE
 
 INTERFACE
@@ -95,7 +95,7 @@ INTERFACE
    END SUBROUTINE
 END INTERFACE
 INTERFACE sbpsendi
-    MODULE PROCEDURE sbpsendi64,sbpsendi32
+    PROCEDURE :: sbpsendi64,sbpsendi32
 END INTERFACE
 
 INTERFACE
@@ -112,7 +112,7 @@ INTERFACE
    END SUBROUTINE
 END INTERFACE
 INTERFACE sbpsendip
-    MODULE PROCEDURE sbpsendip64,sbpsendip32
+    PROCEDURE :: sbpsendip64,sbpsendip32
 END INTERFACE
 
 INTERFACE
@@ -129,7 +129,7 @@ INTERFACE
    END SUBROUTINE
 END INTERFACE
 INTERFACE sbpsendd
-    MODULE PROCEDURE sbpsendd64,sbpsendd32
+    PROCEDURE :: sbpsendd64,sbpsendd32
 END INTERFACE
 
 INTERFACE
@@ -146,7 +146,81 @@ INTERFACE
    END SUBROUTINE
 END INTERFACE
 INTERFACE sbpsenddp
-    MODULE PROCEDURE sbpsenddp64,sbpsenddp32
+    PROCEDURE :: sbpsenddp64,sbpsenddp32
+END INTERFACE
+
+!!!!!!!!!!! batched sending !!!!!!!!!!!
+! a batch is an opaque handle stored in an INTEGER(sbp_int_8), messages are sent at
+! sbpbatchflush, arrays larger than 512 bytes must not change before the flush
+
+INTERFACE
+   SUBROUTINE sbpbatchinit(ierr,batch,sock)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+    INTEGER(selected_int_kind(18)) :: batch
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpbatchfree(ierr,batch)
+    INTEGER(selected_int_kind(6)) :: ierr
+    INTEGER(selected_int_kind(18)) :: batch
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpbatchflush(ierr,batch)
+    INTEGER(selected_int_kind(6)) :: ierr
+    INTEGER(selected_int_kind(18)) :: batch
+   END SUBROUTINE
+END INTERFACE
+
+INTERFACE
+   SUBROUTINE sbpbatchc32n(ierr,batch,str)
+    INTEGER(selected_int_kind(6)) :: ierr
+    INTEGER(selected_int_kind(18)) :: batch
+    CHARACTER(LEN=*) :: str
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpbatchc64n(ierr,batch,str)
+    INTEGER(selected_int_kind(6)) :: ierr
+    INTEGER(selected_int_kind(18)) :: batch
+    CHARACTER(LEN=*) :: str
+   END SUBROUTINE
+END INTERFACE
+
+INTERFACE
+   SUBROUTINE sbpbatchi64(ierr,batch,iarr,len)
+    INTEGER(selected_int_kind(6)) :: ierr
+    INTEGER(selected_int_kind(18)) :: batch,len
+    INTEGER(selected_int_kind(6)), dimension(*) :: iarr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpbatchi32(ierr,batch,iarr,len)
+    INTEGER(selected_int_kind(6)) :: ierr,len
+    INTEGER(selected_int_kind(18)) :: batch
+    INTEGER(selected_int_kind(6)), dimension(*) :: iarr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE sbpbatchi
+    PROCEDURE :: sbpbatchi64,sbpbatchi32
+END INTERFACE
+
+INTERFACE
+   SUBROUTINE sbpbatchd64(ierr,batch,arr,len)
+    INTEGER(selected_int_kind(6)) :: ierr
+    INTEGER(selected_int_kind(18)) :: batch,len
+    REAL(selected_real_kind(14,200)), dimension(*) :: arr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpbatchd32(ierr,batch,arr,len)
+    INTEGER(selected_int_kind(6)) :: ierr,len
+    INTEGER(selected_int_kind(18)) :: batch
+    REAL(selected_real_kind(14,200)), dimension(*) :: arr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE sbpbatchd
+    PROCEDURE :: sbpbatchd64,sbpbatchd32
 END INTERFACE
 
 !!!!!!!!!!! receiving !!!!!!!!!!!
@@ -163,7 +237,7 @@ INTERFACE
    END SUBROUTINE
 END INTERFACE
 INTERFACE sbpreadh
-    MODULE PROCEDURE sbpreadh64,sbpreadh32
+    PROCEDURE :: sbpreadh64,sbpreadh32
 END INTERFACE
 
 INTERFACE
@@ -208,7 +282,7 @@ INTERFACE
    END SUBROUTINE
 END INTERFACE
 INTERFACE sbpreadi
-    MODULE PROCEDURE sbpreadi64, sbpreadi32
+    PROCEDURE :: sbpreadi64, sbpreadi32
 END INTERFACE
 
 INTERFACE
@@ -225,7 +299,7 @@ INTERFACE
    END SUBROUTINE
 END INTERFACE
 INTERFACE sbpreadip
-    MODULE PROCEDURE sbpreadip64, sbpreadip32
+    PROCEDURE :: sbpreadip64, sbpreadip32
 END INTERFACE
 
 INTERFACE
@@ -242,7 +316,7 @@ INTERFACE
    END SUBROUTINE
 END INTERFACE
 INTERFACE sbpreadd
-    MODULE PROCEDURE sbpreadd64, sbpreadd32
+    PROCEDURE :: sbpreadd64, sbpreadd32
 END INTERFACE
 
 INTERFACE
@@ -259,7 +333,248 @@ INTERFACE
    END SUBROUTINE
 END INTERFACE
 INTERFACE sbpreaddp
-    MODULE PROCEDURE sbpreaddp64, sbpreaddp32
+    PROCEDURE :: sbpreaddp64, sbpreaddp32
+END INTERFACE
+
+!!!!!!!!!!! buffered receiving !!!!!!!!!!!
+! after sbpreaderattach all reads on sock are served from a buffer of bufsize bytes
+! (0 for the default size)
+
+INTERFACE
+   SUBROUTINE sbpreaderattach(ierr,sock,bufsize)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+    INTEGER(selected_int_kind(18)) :: bufsize
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpreaderdetach(ierr,sock)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+   END SUBROUTINE
+END INTERFACE
+
+!!!!!!!!!!! zero copy transfers !!!!!!!!!!!
+! fd is a unix file descriptor, the file content is sent/received as is.
+! zc is an opaque handle stored in an INTEGER(sbp_int_8), an array sent with
+! sbpzcsendi64/sbpzcsendd64 must not change before sbpzcwait on its ticket returns
+
+INTERFACE
+   SUBROUTINE sbpsendfd64(ierr,sock,kind,fd,offset,len)
+    INTEGER(selected_int_kind(6)) :: ierr,sock,kind,fd
+    INTEGER(selected_int_kind(18)) :: offset,len
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpsendfdp64(ierr,sock,fd,offset,len)
+    INTEGER(selected_int_kind(6)) :: ierr,sock,fd
+    INTEGER(selected_int_kind(18)) :: offset,len
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpreadfd64(ierr,sock,kind,fd,offset,len)
+    INTEGER(selected_int_kind(6)) :: ierr,sock,kind,fd
+    INTEGER(selected_int_kind(18)) :: offset,len
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpreadfdp64(ierr,sock,fd,offset,len)
+    INTEGER(selected_int_kind(6)) :: ierr,sock,fd
+    INTEGER(selected_int_kind(18)) :: offset,len
+   END SUBROUTINE
+END INTERFACE
+
+INTERFACE
+   SUBROUTINE sbpzcinit(ierr,zc,sock)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+    INTEGER(selected_int_kind(18)) :: zc
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpzcfree(ierr,zc)
+    INTEGER(selected_int_kind(6)) :: ierr
+    INTEGER(selected_int_kind(18)) :: zc
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpzcsendi64(ierr,zc,iarr,len,ticket)
+    INTEGER(selected_int_kind(6)) :: ierr,ticket
+    INTEGER(selected_int_kind(18)) :: zc,len
+    INTEGER(selected_int_kind(6)), dimension(*) :: iarr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpzcsendd64(ierr,zc,arr,len,ticket)
+    INTEGER(selected_int_kind(6)) :: ierr,ticket
+    INTEGER(selected_int_kind(18)) :: zc,len
+    REAL(selected_real_kind(14,200)), dimension(*) :: arr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpzcwait(ierr,zc,ticket)
+    INTEGER(selected_int_kind(6)) :: ierr,ticket
+    INTEGER(selected_int_kind(18)) :: zc
+   END SUBROUTINE
+END INTERFACE
+
+!!!!!!!!!!! shared memory transport !!!!!!!!!!!
+! with enable=1 the connections made afterwards to/from a local peer (that also
+! enabled it) use shared memory rings of ringsize bytes (0 for the default)
+
+INTERFACE
+   SUBROUTINE sbpshmenable(ierr,enable,ringsize)
+    INTEGER(selected_int_kind(6)) :: ierr,enable
+    INTEGER(selected_int_kind(18)) :: ringsize
+   END SUBROUTINE
+END INTERFACE
+
+!!!!!!!!!!! packed payloads !!!!!!!!!!!
+! with enable=1 the int and double arrays of at least minlen bytes (0 for the default)
+! sent on the connections made afterwards to a peer that also enabled it are compressed
+
+INTERFACE
+   SUBROUTINE sbppackenable(ierr,enable,minlen)
+    INTEGER(selected_int_kind(6)) :: ierr,enable
+    INTEGER(selected_int_kind(18)) :: minlen
+   END SUBROUTINE
+END INTERFACE
+
+!!!!!!!!!!! multiplexed channels !!!!!!!!!!!
+! a mux (opaque handle in an INTEGER(selected_int_kind(18))) carries several channels
+! on one connection, both sides must use one, fragsize=0 selects the default fragments
+
+INTERFACE
+   SUBROUTINE sbpmuxinit(ierr,mux,sock,fragsize)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+    INTEGER(selected_int_kind(18)) :: mux,fragsize
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpmuxfree(ierr,mux)
+    INTEGER(selected_int_kind(6)) :: ierr
+    INTEGER(selected_int_kind(18)) :: mux
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpmuxsendc64n(ierr,mux,channel,str)
+    INTEGER(selected_int_kind(6)) :: ierr,channel
+    INTEGER(selected_int_kind(18)) :: mux
+    CHARACTER(len=*) :: str
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpmuxsendi64(ierr,mux,channel,iarr,len)
+    INTEGER(selected_int_kind(6)) :: ierr,channel
+    INTEGER(selected_int_kind(18)) :: mux,len
+    INTEGER(selected_int_kind(6)), dimension(*) :: iarr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpmuxsendd64(ierr,mux,channel,arr,len)
+    INTEGER(selected_int_kind(6)) :: ierr,channel
+    INTEGER(selected_int_kind(18)) :: mux,len
+    REAL(selected_real_kind(14,200)), dimension(*) :: arr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpmuxreadc64n(ierr,mux,channel,str)
+    INTEGER(selected_int_kind(6)) :: ierr,channel
+    INTEGER(selected_int_kind(18)) :: mux
+    CHARACTER(len=*) :: str
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpmuxreadi64(ierr,mux,channel,iarr,len)
+    INTEGER(selected_int_kind(6)) :: ierr,channel
+    INTEGER(selected_int_kind(18)) :: mux,len
+    INTEGER(selected_int_kind(6)), dimension(*) :: iarr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpmuxreadd64(ierr,mux,channel,arr,len)
+    INTEGER(selected_int_kind(6)) :: ierr,channel
+    INTEGER(selected_int_kind(18)) :: mux,len
+    REAL(selected_real_kind(14,200)), dimension(*) :: arr
+   END SUBROUTINE
+END INTERFACE
+
+!!!!!!!!!!! non blocking communication !!!!!!!!!!!
+! requests are opaque handles stored in an INTEGER(sbp_int_8), the arrays (and rlen
+! of sbpirecvc64n) must not be used until sbptest/sbpwait/sbpwaitany complete the
+! request, which is then freed and set to 0. sbpwaitany returns a 1 based index.
+
+INTERFACE
+   SUBROUTINE sbpisendc64n(ierr,sock,str,req)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+    CHARACTER(len=*) :: str
+    INTEGER(selected_int_kind(18)) :: req
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpisendi64(ierr,sock,iarr,len,req)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+    INTEGER(selected_int_kind(18)) :: len,req
+    INTEGER(selected_int_kind(6)), dimension(*) :: iarr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpisendd64(ierr,sock,arr,len,req)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+    INTEGER(selected_int_kind(18)) :: len,req
+    REAL(selected_real_kind(14,200)), dimension(*) :: arr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpirecvc64n(ierr,sock,str,rlen,req)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+    CHARACTER(len=*) :: str
+    INTEGER(selected_int_kind(18)) :: rlen,req
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpirecvi64(ierr,sock,iarr,len,req)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+    INTEGER(selected_int_kind(18)) :: len,req
+    INTEGER(selected_int_kind(6)), dimension(*) :: iarr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpirecvd64(ierr,sock,arr,len,req)
+    INTEGER(selected_int_kind(6)) :: ierr,sock
+    INTEGER(selected_int_kind(18)) :: len,req
+    REAL(selected_real_kind(14,200)), dimension(*) :: arr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbptest(ierr,req,flag)
+    INTEGER(selected_int_kind(6)) :: ierr,flag
+    INTEGER(selected_int_kind(18)) :: req
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpwait(ierr,req)
+    INTEGER(selected_int_kind(6)) :: ierr
+    INTEGER(selected_int_kind(18)) :: req
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpwaitany(ierr,count,reqs,index)
+    INTEGER(selected_int_kind(6)) :: ierr,count,index
+    INTEGER(selected_int_kind(18)), dimension(*) :: reqs
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpprogress(ierr)
+    INTEGER(selected_int_kind(6)) :: ierr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpprogstart(ierr)
+    INTEGER(selected_int_kind(6)) :: ierr
+   END SUBROUTINE
+END INTERFACE
+INTERFACE
+   SUBROUTINE sbpprogstop(ierr)
+    INTEGER(selected_int_kind(6)) :: ierr
+   END SUBROUTINE
 END INTERFACE
 
 !!! connection